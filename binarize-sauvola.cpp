@@ -43,9 +43,12 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -56,21 +59,26 @@
 #include <opencv2/imgproc.hpp>
 
 #include "microlib/argparse.hpp"
+#include "microlib/localstat.hpp"
+#include "microlib/resample.hpp"
+#include "microlib/sauvola.hpp"
+#include "microlib/statcache.hpp"
 
 using namespace std;
 using namespace cv;
 
 
 
-#if 1
 // 16843009^2 * 255^2 < 2^64
 static const long windowSizeLimit = 16843009;
-typedef uint_least64_t intimage_type;
-#else
 // 257^2 * 255^2 < 2^32
-static const long windowSizeLimit = 257;
-typedef uint_least32_t intimage_type;
-#endif
+// (window sums stay exact even if 32-bit integral images wrap around)
+static const long windowSizeLimit32 = 257;
+// 4104^2 * 255 < 2^32 (window sums of values only)
+static const long meanWindowSizeLimit32 = 4104;
+static const int multiScaleLevelsLimit = 16;
+// Bins of the histogram for -k auto (over K in [0, 1])
+static const int autoKBins = 256;
 
 enum ProgramMode
 {
@@ -81,46 +89,170 @@ enum ProgramMode
 	OUT_VARIABLE_MULTIW,
 };
 
+enum ThresholdMethod
+{
+	METHOD_SAUVOLA,
+	METHOD_WOLF,
+	METHOD_NIBLACK,
+	METHOD_NICK,
+	METHOD_PHANSALKAR,
+	METHOD_BRADLEY,
+};
+
+struct ThresholdParams
+{
+	double kParam;
+	double rScale;
+	double tScale;
+	double tBias;
+};
+
+/*
+	Image to binarize
+	(or the source image, if resampled on demand by prescaler)
+*/
+struct InputImage
+{
+	Mat img; // grayscale, or BGR with --color
+	unique_ptr<resample_lanczos4> prescaler;
+	int cols, rows;
+};
+
+// Minimum number of prescaled rows to compute local statistics at once
+// (unless --tile is given)
+static const int prescaleBandRows = 256;
+
 static const int defaultWindowSize = 60;
 static const double defaultKParam  = 0.4;
+static const double defaultWolfKParam = 0.5;
+static const double defaultNiblackKParam = -0.2;
+static const double defaultNickKParam = -0.1;
+static const double defaultPhansalkarKParam = 0.25;
+static const double defaultBradleyKParam = 0.15;
 static_assert(defaultWindowSize <= windowSizeLimit, "defaultWindowSize must not exceed windowSizeLimit.");
 
 static ProgramMode programMode = OUT_BINARY;
+static ThresholdMethod method = METHOD_SAUVOLA;
 static const char* filename_in;
 static const char* filename_out;
 static double preScale    = 1.0;
+static bool   fusedPrescale = false;
+static bool   colorInput  = false;
 static int    windowSize  = defaultWindowSize;
-static double kParam      = defaultKParam;
-static double rScale      = 1.0;
-static double tScale      = 1.0;
-static double tBias       = 0.0;
+static vector<double> kParams; // empty: default of the method
+static bool autoK = false;
+static vector<double> rScales = { 1.0 };
+static vector<double> tScales = { 1.0 };
+static vector<double> tBiases = { 0.0 };
+// All combinations of above (one output for each)
+static vector<ThresholdParams> thresholdParams;
 static vector<int> multiWindowSize;
+static vector<int> statWindowSize; // distinct ones of multiWindowSize
+static localstat_engine engine = LOCALSTAT_ENGINE_INTEGRAL;
+static int integralBits = 0; // 0: auto
+static sauvola_simd simd = SAUVOLA_SIMD_AUTO;
+static sauvola_precision precision = SAUVOLA_PRECISION_DOUBLE;
+static bool precisionCheck = false;
+static int threads = 1;
+static int tileRows = 0; // 0: whole image at once
+static const char* statsCacheFile = nullptr;
+static int  gridStep  = 0; // 0: exact, -1: auto (WINDOW_SIZE / 4)
+static bool gridCheck = false;
+static int  multiScaleLevels = 0; // 0: single scale
+static statcache statsCache;
+static bool statsCached = false; // statsCache holds complete statistics
 
 
 
 static void usage(int argc, char** argv, int ret = 1)
 {
 	fprintf(stderr,
-		"usage: %s [-S SCALE] [-w WINDOW_SIZE] [-k K] [-r RSCALE] [-t T] [-T | -V | -X W1,W2,W3] IN OUT\n"
+		"usage: %s [-S SCALE] [--method METHOD] [-w WINDOW_SIZE] [-k K] [-r RSCALE] [-t T] [-b B] [-E ENGINE] [-j THREADS] [-T | -V | -X W1,W2,W3] IN OUT\n"
 		"   -h | --help      show this help\n"
 		"   -v | --version   show version information\n"
 		"   -S SCALE         scale image by Lanczos4 prior to binarization [1.0]\n"
+		"   --fused-prescale resample rows of the prescaled image on demand\n"
+		"                    (without keeping the whole prescaled image)\n"
+		"   --color          keep colour images in BGR and compute luminance while\n"
+		"                    accumulating local statistics (no grayscale copy of\n"
+		"                     the page; luminance follows cvtColor and may differ\n"
+		"                     by one level from grayscale decoding)\n"
+		"   --method METHOD  set thresholding method  [sauvola]\n"
+		"                    (sauvola, niblack, nick, phansalkar,\n"
+		"                     wolf: Wolf and Jolion's method,\n"
+		"                     normalized by the contrast of the whole page,\n"
+		"                     or bradley: Bradley and Roth's method, MEAN * (1 - K),\n"
+		"                     using local means only with half the memory)\n"
 		"   -w WINDOW_SIZE   set window size          [%d]\n"
 		"   -k K             set K parameter for Sauvola's algorithm [%f]\n"
+		"                    (default for wolf: %f, niblack: %f, nick: %f, phansalkar: %f,\n"
+		"                     bradley: %f;\n"
+		"                     negative values are allowed for niblack and nick;\n"
+		"                     auto: choose K for each page from local statistics (sauvola only))\n"
 		"   -r RSCALE        set scale of R parameter [1.0]\n"
-		"                    (1.0 for maximum standard deviation possible)\n"
+		"                    (1.0 for maximum standard deviation possible,\n"
+		"                     or the maximum local standard deviation of the page for wolf)\n"
 		"   -t T             set threshold scale      [1.0]\n"
 		"   -b B             set threshold bias       [0.0]\n"
+		"                    (K, RSCALE, T and B accept comma-separated lists to write\n"
+		"                     one image per combination, named OUT-kK-rRSCALE-tT-bB.EXT)\n"
+		"   -E ENGINE        set engine to compute local statistics [integral]\n"
+		"                    (integral: whole-page integral images, stream: rolling integral rows,\n"
+		"                     clamped: unpadded integral images, column: running column sums,\n"
+		"                     interleaved: whole-page integral images stored as sum pairs)\n"
+		"   --integral-bits BITS\n"
+		"                    set width of integral images (32, 64 or auto) [auto]\n"
+		"                    (32 requires WINDOW_SIZE <= %ld or %ld for bradley,\n"
+		"                     auto uses 32 if possible)\n"
+		"   -j THREADS       set number of threads    [1]\n"
+		"                    (0 for the number of CPUs)\n"
+		"   --tile ROWS      compute local statistics in strips of ROWS rows\n"
+		"                    (bounded memory for very large images, same output)\n"
+		"   --simd SIMD      set SIMD implementation  [auto]\n"
+		"                    (none, sse4.2, avx2 or auto)\n"
+		"   --precision PRECISION\n"
+		"                    set arithmetic of local thresholds (double or float) [double]\n"
+		"                    (float: twice as many pixels per vector with AVX2 and 32-bit\n"
+		"                     integral images, falling back to double near the threshold)\n"
+		"   --precision-check\n"
+		"                    report pixels differing between float and double precision\n"
+		"   --grid STEP      approximate thresholds by bilinear interpolation between\n"
+		"                    exact ones on a grid of STEP pixels (or auto: WINDOW_SIZE/4)\n"
+		"   --grid-check     report deviation of grid-approximated thresholds\n"
+		"   --multiscale LEVELS\n"
+		"                    binarize LEVELS times halved images with the same window size\n"
+		"                    and take thresholds of each object from the level fitting its size\n"
+		"                    (multiscale Sauvola's algorithm by Lazzara and Geraud)\n"
+		"   --stats-cache FILE\n"
+		"                    reuse local statistics in FILE if it matches the input,\n"
+		"                    SCALE and window sizes (otherwise, store them to FILE)\n"
 		"   -T               write threshold image instead of binary image\n"
 		"   -V               write variable threshold image instead of standard image\n"
 		"   -P               write pixelwise input image instead of binary image\n"
 		"                    (RGB mapping: R=~intensity, G=variance, B=mean)\n"
 		"   -X W1,W2,W3      write multi window size, variable threshold image\n"
 		"                    (RGB mapping: R=W1, G=W2, B=W3)\n",
-		argv[0], defaultWindowSize, defaultKParam);
+		argv[0], defaultWindowSize, defaultKParam,
+		defaultWolfKParam, defaultNiblackKParam, defaultNickKParam, defaultPhansalkarKParam,
+		defaultBradleyKParam, windowSizeLimit32, meanWindowSizeLimit32);
 	exit(ret);
 }
 
+static vector<double> argparseDoubleList(const char* opt, const char* optarg, bool allow_infinity = false)
+{
+	vector<double> values;
+	string arg(optarg);
+	size_t p0 = 0, p1;
+	do
+	{
+		p1 = min(arg.find_first_of(',', p0), arg.size());
+		string token(arg, p0, p1 - p0);
+		values.push_back(argparse_double(opt, token.c_str(), allow_infinity));
+		p0 = p1 + 1;
+	} while (p1 < arg.size());
+	return values;
+}
+
 static void argparse(int argc, char** argv)
 {
 	unordered_map<string, ProgramMode> pmodes = {
@@ -137,24 +269,72 @@ static void argparse(int argc, char** argv)
 		{ "multiw",          OUT_VARIABLE_MULTIW },
 		{ "variable-multiw", OUT_VARIABLE_MULTIW },
 	};
+	unordered_map<string, ThresholdMethod> methods = {
+		{ "sauvola", METHOD_SAUVOLA },
+		{ "wolf",    METHOD_WOLF },
+		{ "wolf-jolion", METHOD_WOLF },
+		{ "niblack", METHOD_NIBLACK },
+		{ "nick",    METHOD_NICK },
+		{ "phansalkar", METHOD_PHANSALKAR },
+		{ "bradley", METHOD_BRADLEY },
+		{ "bradley-roth", METHOD_BRADLEY },
+	};
+	unordered_map<string, localstat_engine> engines = {
+		{ "integral",  LOCALSTAT_ENGINE_INTEGRAL },
+		{ "default",   LOCALSTAT_ENGINE_INTEGRAL },
+		{ "stream",    LOCALSTAT_ENGINE_STREAM },
+		{ "streaming", LOCALSTAT_ENGINE_STREAM },
+		{ "clamped",       LOCALSTAT_ENGINE_CLAMPED },
+		{ "padding-free",  LOCALSTAT_ENGINE_CLAMPED },
+		{ "column",        LOCALSTAT_ENGINE_COLUMN },
+		{ "sliding",       LOCALSTAT_ENGINE_COLUMN },
+		{ "interleaved",   LOCALSTAT_ENGINE_INTERLEAVED },
+	};
+	unordered_map<string, sauvola_simd> simds = {
+		{ "none",   SAUVOLA_SIMD_NONE },
+		{ "scalar", SAUVOLA_SIMD_NONE },
+		{ "sse4.2", SAUVOLA_SIMD_SSE42 },
+		{ "sse42",  SAUVOLA_SIMD_SSE42 },
+		{ "avx2",   SAUVOLA_SIMD_AVX2 },
+		{ "auto",   SAUVOLA_SIMD_AUTO },
+	};
+	unordered_map<string, sauvola_precision> precisions = {
+		{ "double", SAUVOLA_PRECISION_DOUBLE },
+		{ "float",  SAUVOLA_PRECISION_FLOAT },
+		{ "single", SAUVOLA_PRECISION_FLOAT },
+	};
 	const struct option longopts[] = {
 		{ "help",              no_argument, 0, 'h' },
 		{ "version",           no_argument, 0, 'v' },
 		{ "prescale",          required_argument, 0, 'S' },
+		{ "fused-prescale",    no_argument,       0, 'F' },
+		{ "color",             no_argument,       0, 'Y' },
 		{ "window-size",       required_argument, 0, 'w' },
 		{ "k-param",           required_argument, 0, 'k' },
 		{ "r-scale",           required_argument, 0, 'r' },
 		{ "threshold-scale",   required_argument, 0, 't' },
 		{ "threshold-bias",    required_argument, 0, 'b' },
 		{ "output-type",       required_argument, 0, 'O' },
+		{ "method",            required_argument, 0, 'A' },
 		{ "multi-window-size", required_argument, 0, 'X' },
+		{ "engine",            required_argument, 0, 'E' },
+		{ "integral-bits",     required_argument, 0, 'M' },
+		{ "threads",           required_argument, 0, 'j' },
+		{ "tile",              required_argument, 0, 'L' },
+		{ "simd",              required_argument, 0, 'D' },
+		{ "precision",         required_argument, 0, 'R' },
+		{ "precision-check",   no_argument,       0, 'K' },
+		{ "stats-cache",       required_argument, 0, 'C' },
+		{ "grid",              required_argument, 0, 'G' },
+		{ "grid-check",        no_argument,       0, 'Q' },
+		{ "multiscale",        required_argument, 0, 'U' },
 		{},
 	};
 	int opt, longindex;
 	try
 	{
 		opterr = 0;
-		while ((opt = getopt_long(argc, argv, ":hvS:w:k:r:t:b:TVPX:", longopts, &longindex)) != -1)
+		while ((opt = getopt_long(argc, argv, ":hvS:w:k:r:t:b:E:j:TVPX:", longopts, &longindex)) != -1)
 		{
 			switch (opt)
 			{
@@ -170,6 +350,12 @@ static void argparse(int argc, char** argv)
 					if (preScale <= 0)
 						throw argparse_error("-S", "prescale value must be positive.");
 					break;
+				case 'F':
+					fusedPrescale = true;
+					break;
+				case 'Y':
+					colorInput = true;
+					break;
 				case 'T':
 					programMode = OUT_THRESHOLD;
 					break;
@@ -207,6 +393,13 @@ static void argparse(int argc, char** argv)
 						throw argparse_error("--output-type", "unknown value.");
 					programMode = p->second;
 				}; break;
+				case 'A':
+				{
+					auto p = methods.find(optarg);
+					if (p == methods.end())
+						throw argparse_error("--method", "unknown value.");
+					method = p->second;
+				}; break;
 				case 'w':
 					windowSize = argparse_int("-w", optarg);
 					if (windowSize < 1)
@@ -215,22 +408,80 @@ static void argparse(int argc, char** argv)
 						throw argparse_error("-w", "window size is too large.");
 					break;
 				case 'k':
-					kParam = argparse_double("-k", optarg, true);
-					if (kParam < 0)
-						throw argparse_error("-k", "k parameter is too small.");
+					autoK = string(optarg) == "auto";
+					kParams.clear();
+					if (!autoK)
+						kParams = argparseDoubleList("-k", optarg, true);
 					break;
 				case 'r':
-					rScale = argparse_double("-r", optarg, true);
-					if (rScale <= 0)
-						throw argparse_error("-r", "R scale must be positive.");
+					rScales = argparseDoubleList("-r", optarg, true);
+					for (double rScale : rScales)
+						if (rScale <= 0)
+							throw argparse_error("-r", "R scale must be positive.");
 					break;
 				case 't':
-					tScale = argparse_double("-t", optarg);
-					if (tScale <= 0)
-						throw argparse_error("-t", "threshold scale must be larger than zero.");
+					tScales = argparseDoubleList("-t", optarg);
+					for (double tScale : tScales)
+						if (tScale <= 0)
+							throw argparse_error("-t", "threshold scale must be larger than zero.");
 					break;
 				case 'b':
-					tBias = argparse_double("-b", optarg);
+					tBiases = argparseDoubleList("-b", optarg);
+					break;
+				case 'E':
+				{
+					auto p = engines.find(optarg);
+					if (p == engines.end())
+						throw argparse_error("-E", "unknown value.");
+					engine = p->second;
+				}; break;
+				case 'M':
+					integralBits = string(optarg) == "auto" ? 0 : argparse_int("--integral-bits", optarg);
+					if (integralBits != 0 && integralBits != 32 && integralBits != 64)
+						throw argparse_error("--integral-bits", "unknown value.");
+					break;
+				case 'j':
+					threads = argparse_int("-j", optarg);
+					if (threads < 0)
+						throw argparse_error("-j", "number of threads must not be negative.");
+					break;
+				case 'L':
+					tileRows = argparse_int("--tile", optarg);
+					if (tileRows < 1)
+						throw argparse_error("--tile", "number of rows must be positive.");
+					break;
+				case 'D':
+				{
+					auto p = simds.find(optarg);
+					if (p == simds.end())
+						throw argparse_error("--simd", "unknown value.");
+					simd = p->second;
+				}; break;
+				case 'R':
+				{
+					auto p = precisions.find(optarg);
+					if (p == precisions.end())
+						throw argparse_error("--precision", "unknown value.");
+					precision = p->second;
+				}; break;
+				case 'K':
+					precisionCheck = true;
+					break;
+				case 'C':
+					statsCacheFile = optarg;
+					break;
+				case 'G':
+					gridStep = string(optarg) == "auto" ? -1 : argparse_int("--grid", optarg);
+					if (gridStep == 0 || gridStep < -1)
+						throw argparse_error("--grid", "grid step must be positive.");
+					break;
+				case 'Q':
+					gridCheck = true;
+					break;
+				case 'U':
+					multiScaleLevels = argparse_int("--multiscale", optarg);
+					if (multiScaleLevels < 1 || multiScaleLevels > multiScaleLevelsLimit)
+						throw argparse_error("--multiscale", "number of levels is out of range.");
 					break;
 				case ':':
 					throw argparse_error(argv[0], "insufficient argument.");
@@ -242,9 +493,81 @@ static void argparse(int argc, char** argv)
 		}
 		if (programMode == OUT_VARIABLE || programMode == OUT_VARIABLE_MULTIW)
 		{
-			if (rScale < 1)
-				throw argparse_error("-r", "R scale must not be less than 1 if variable output is enabled.");
+			for (double rScale : rScales)
+				if (rScale < 1)
+					throw argparse_error("-r", "R scale must not be less than 1 if variable output is enabled.");
+		}
+		if (autoK)
+		{
+			if (method != METHOD_SAUVOLA)
+				throw argparse_error("-k", "value of auto is only supported by sauvola.");
+			if (programMode != OUT_BINARY && programMode != OUT_THRESHOLD)
+				throw argparse_error("-k", "value of auto requires binary or threshold output.");
+			if (gridStep != 0 || multiScaleLevels)
+				throw argparse_error("-k", "value of auto cannot be combined with grid approximation or multiscale binarization.");
 		}
+		if (kParams.empty())
+		{
+			switch (method)
+			{
+				case METHOD_WOLF:       kParams.push_back(defaultWolfKParam);       break;
+				case METHOD_NIBLACK:    kParams.push_back(defaultNiblackKParam);    break;
+				case METHOD_NICK:       kParams.push_back(defaultNickKParam);       break;
+				case METHOD_PHANSALKAR: kParams.push_back(defaultPhansalkarKParam); break;
+				case METHOD_BRADLEY:    kParams.push_back(defaultBradleyKParam);    break;
+				default:                kParams.push_back(defaultKParam);           break;
+			}
+		}
+		if (method != METHOD_NIBLACK && method != METHOD_NICK)
+		{
+			for (double kParam : kParams)
+				if (kParam < 0)
+					throw argparse_error("-k", "k parameter is too small.");
+		}
+		for (double kParam : kParams)
+			for (double rScale : rScales)
+				for (double tScale : tScales)
+					for (double tBias : tBiases)
+						thresholdParams.push_back({ kParam, rScale, tScale, tBias });
+		if (thresholdParams.size() > 1 && (programMode == OUT_PIXELINFO || programMode == OUT_VARIABLE_MULTIW))
+			throw argparse_error(argv[0], "parameter lists are not supported with this output type.");
+		if (method == METHOD_WOLF && programMode != OUT_BINARY && programMode != OUT_THRESHOLD)
+			throw argparse_error("--method", "wolf requires binary or threshold output.");
+		if (method == METHOD_WOLF && gridStep != 0)
+			throw argparse_error("--method", "wolf cannot be combined with grid approximation.");
+		if (method == METHOD_BRADLEY)
+		{
+			if (programMode != OUT_BINARY && programMode != OUT_THRESHOLD)
+				throw argparse_error("--method", "bradley requires binary or threshold output.");
+			if (gridStep != 0 || statsCacheFile || tileRows || fusedPrescale)
+				throw argparse_error("--method", "bradley cannot be combined with grid approximation, statistics cache, tiles or fused prescaling.");
+			if (engine != LOCALSTAT_ENGINE_INTEGRAL)
+				throw argparse_error("--method", "bradley requires the integral engine.");
+		}
+		if (gridStep != 0 && programMode != OUT_BINARY && programMode != OUT_THRESHOLD)
+			throw argparse_error("--grid", "grid approximation requires binary or threshold output.");
+		if (multiScaleLevels)
+		{
+			if (programMode != OUT_BINARY)
+				throw argparse_error("--multiscale", "multiscale binarization requires binary output.");
+			if (method == METHOD_WOLF || method == METHOD_BRADLEY)
+				throw argparse_error("--multiscale", "multiscale binarization does not support this method.");
+			if (gridStep != 0)
+				throw argparse_error("--multiscale", "multiscale binarization cannot be combined with grid approximation.");
+		}
+		if (gridCheck && gridStep == 0)
+			throw argparse_error("--grid-check", "requires a `--grid' option.");
+		if (precisionCheck)
+		{
+			if (precision != SAUVOLA_PRECISION_FLOAT)
+				throw argparse_error("--precision-check", "requires a `--precision float' option.");
+			if (programMode != OUT_BINARY && programMode != OUT_THRESHOLD)
+				throw argparse_error("--precision-check", "requires binary or threshold output.");
+			if (method == METHOD_WOLF || method == METHOD_BRADLEY || autoK || multiScaleLevels || gridStep != 0)
+				throw argparse_error("--precision-check", "cannot be combined with wolf, bradley, automatic K, multiscale binarization or grid approximation.");
+		}
+		if (fusedPrescale && (gridStep != 0 || statsCacheFile))
+			throw argparse_error("--fused-prescale", "cannot be combined with grid approximation or statistics cache.");
 		if (programMode == OUT_VARIABLE_MULTIW)
 		{
 			if (multiWindowSize.size() == 0)
@@ -257,6 +580,13 @@ static void argparse(int argc, char** argv)
 		{
 			multiWindowSize = { windowSize };
 		}
+		for (int wsize : multiWindowSize)
+			if (find(statWindowSize.begin(), statWindowSize.end(), wsize) == statWindowSize.end())
+				statWindowSize.push_back(wsize);
+		if (gridStep == -1)
+			gridStep = max(1, windowSize / 4);
+		if (integralBits == 32 && windowSize > (method == METHOD_BRADLEY ? meanWindowSizeLimit32 : windowSizeLimit32))
+			throw argparse_error("--integral-bits", "window size is too large for 32-bit integral images.");
 		if (argc - optind != 2)
 			usage(argc, argv, 1);
 		filename_in  = argv[optind++];
@@ -271,189 +601,888 @@ static void argparse(int argc, char** argv)
 
 
 
-int main(int argc, char** argv)
+/*
+	Variable Threshold Image:
+	In Sauvola's algorithm, increasing K makes some black pixels white.
+	The intensity of each pixel in this mode is determined by
+	the lowest K value (Kt) which makes given pixel white.
+	White: Kt == 0, Black: Kt >= 1
+	(for other methods, thresholds are linear in K as well and the intensity
+	is the fraction of K values in [0, 1] which make given pixel white)
+*/
+static inline unsigned char variableThreshold(double v, double mean, double var, sauvola_params params)
 {
-	argparse(argc, argv);
-	Mat img = imread(filename_in, IMREAD_GRAYSCALE);
-	if (!img.data)
+	params.kParam = 0;
+	double th1 = sauvola_threshold(mean, var, params);
+	params.kParam = 1;
+	double th0 = sauvola_threshold(mean, var, params);
+	// th0 <= th1 in Sauvola's algorithm while rScale >= 1.0.
+	if (th0 > th1)
+		swap(th0, th1);
+	v = max(min(v, th1), th0);
+	return 255.0 * (v - th0) / (th1 - th0);
+}
+
+/*
+	Local statistics in strips of (at most) tile rows:
+	each strip is processed with enough rows around it to fill the windows
+	(prescaled rows are resampled into a buffer of tile + wsize rows per
+	thread, keeping rows shared with the previous strip, so each row is
+	resampled once), so memory usage is bounded by the strip size and the
+	result is identical to a single run.
+*/
+template <typename T, typename F>
+static bool runTiledStatistics(const InputImage& in, const vector<int>& wsizes, int tile, F func)
+{
+	int w = in.cols;
+	int h = in.rows;
+	int wsize = *max_element(wsizes.begin(), wsizes.end());
+	int win_n = wsize / 2 + wsize % 2;
+	int win_p = wsize / 2;
+	int ntiles = (h - 1) / tile + 1;
+	vector<char> tileOk(ntiles);
+	localstat_parallel(threads, ntiles, [&](int t0, int t1)
 	{
-		fprintf(stderr, "%s: image could not be loaded.\n", filename_in);
-		return 1;
+		Mat rows, strip;
+		int s0 = 0, s1 = 0; // prescaled rows held in strip
+		vector<unsigned char> gray(in.img.channels() == 1 ? 0 : w);
+		for (int t = t0; t < t1; t++)
+		{
+			int y0 = int((long long)tile * t);
+			int y1 = int(min<long long>(h, (long long)y0 + tile));
+			int r0 = max(0, y0 - win_n);
+			int r1 = int(min<long long>(h, (long long)y1 + win_p));
+			if (in.prescaler)
+			{
+				if (strip.empty())
+					strip.create(int(min<long long>(h, (long long)tile + wsize)), w, CV_8U);
+				int keep = max(0, s1 - r0);
+				if (keep)
+					memmove(strip.ptr<unsigned char>(0), strip.ptr<unsigned char>(r0 - s0), keep * strip.step);
+				in.prescaler->rows(r0 + keep, r1, strip.ptr<unsigned char>(keep), strip.step);
+				s0 = r0;
+				s1 = r1;
+				rows = strip.rowRange(0, r1 - r0);
+			}
+			else
+				rows = in.img.rowRange(r0, r1);
+			tileOk[t] = localstat_run_rows<T>(engine, rows, wsizes, y0 - r0, y1 - r0, [&](int y, const T* sum1, const T* sum2)
+			{
+				func(r0 + y, localstat_row(rows, y, gray.data()), sum1, sum2);
+			});
+		}
+	});
+	return find(tileOk.begin(), tileOk.end(), 0) == tileOk.end();
+}
+
+/*
+	Local statistics for given window sizes:
+	func(y, pixels, sum1, sum2) is called for each row with grayscale pixels
+	(read from or stored to the statistics cache if enabled)
+*/
+template <typename T, typename F>
+static bool runStatistics(const InputImage& in, const vector<int>& wsizes, F func)
+{
+	const Mat& img = in.img;
+	int h = in.rows;
+	size_t stride = size_t(in.cols) * wsizes.size();
+	if (statsCached)
+	{
+		const T* sum1 = (const T*)statsCache.sum1();
+		const T* sum2 = (const T*)statsCache.sum2();
+		localstat_parallel(threads, h, [&](int y0, int y1)
+		{
+			for (int y = y0; y < y1; y++)
+				func(y, img.ptr<unsigned char>(y), sum1 + stride * y, sum2 + stride * y);
+		});
+		return true;
 	}
-	if (img.empty())
+	T* cache1 = (T*)statsCache.sum1();
+	T* cache2 = (T*)statsCache.sum2();
+	auto store = [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
 	{
-		fprintf(stderr, "%s: image is empty.\n", filename_in);
-		return 1;
+		if (statsCache.is_open())
+		{
+			copy(sum1, sum1 + stride, cache1 + stride * y);
+			copy(sum2, sum2 + stride, cache2 + stride * y);
+		}
+		func(y, p, sum1, sum2);
+	};
+	if (tileRows)
+		return runTiledStatistics<T>(in, wsizes, tileRows, store);
+	if (in.prescaler)
+	{
+		// Strips of rows resampled at once (with some rows around them):
+		// at least the window, so that rows are processed at most twice
+		int wsize = *max_element(wsizes.begin(), wsizes.end());
+		int tile = max(prescaleBandRows, wsize);
+		return runTiledStatistics<T>(in, wsizes, tile, store);
 	}
-	int w = img.cols;
-	int h = img.rows;
+	auto pixels = [&](int y, const T* sum1, const T* sum2)
+	{
+		// Rows of colour images are converted again (rows may be concurrent)
+		vector<unsigned char> gray(img.channels() == 1 ? 0 : in.cols);
+		store(y, localstat_row(img, y, gray.data()), sum1, sum2);
+	};
+	return wsizes.size() == 1
+		? localstat_run<T>(engine, img, wsizes[0], pixels, threads)
+		: localstat_run<T>(engine, img, wsizes, pixels, threads);
+}
 
-	// Resize image if necessary
-	if (preScale != 1.0)
+/*
+	Whether grayscale pixels of in are only available row by row from
+	runStatistics (resampled on demand or converted from colour):
+	methods reading pixels again afterwards have to keep them.
+*/
+static bool rowsOnDemand(const InputImage& in)
+{
+	return in.prescaler || in.img.channels() != 1;
+}
+
+static sauvola_params sauvolaParams(const ThresholdParams& tp, int wsize)
+{
+	// Supplementary parameters
+	double rParam = tp.rScale * (255.0 * 0.5);
+	double tRealBias = 255.0 * tp.tBias;
+	double invsqWindow = 1.0 / wsize / wsize;
+	sauvola_method m = SAUVOLA_METHOD_SAUVOLA;
+	switch (method)
 	{
-		if (preScale * w + 1 >= numeric_limits<int>::max() || preScale * h + 1 >= numeric_limits<int>::max())
+		case METHOD_NIBLACK:    m = SAUVOLA_METHOD_NIBLACK;    break;
+		case METHOD_NICK:       m = SAUVOLA_METHOD_NICK;       break;
+		case METHOD_PHANSALKAR: m = SAUVOLA_METHOD_PHANSALKAR; break;
+		default: break;
+	}
+	return { invsqWindow, tp.tScale, tp.kParam, rParam, tRealBias, m, precision };
+}
+
+// Kernels of sauvola_row (prepared once for all rows)
+static vector<sauvola_kernel> sauvolaKernels(const vector<sauvola_params>& params)
+{
+	vector<sauvola_kernel> kernels;
+	for (const sauvola_params& p : params)
+		kernels.push_back(sauvola_prepare(p));
+	return kernels;
+}
+
+/*
+	Mode: output type (a kernel is compiled for each mode)
+	dst: one image for each of thresholdParams (unused on OUT_PIXELINFO)
+	T: type of integral images
+	(uint_least32_t requires wsize <= windowSizeLimit32)
+*/
+template <ProgramMode Mode, typename T>
+static bool binarizeKernel(vector<Mat>& dst, Mat& realdst, const InputImage& in, int wsize)
+{
+	int w = in.cols;
+	size_t n = thresholdParams.size();
+	vector<sauvola_params> params(n);
+	for (size_t i = 0; i < n; i++)
+		params[i] = sauvolaParams(thresholdParams[i], wsize);
+	double invsqWindow = params[0].invsqWindow;
+	// Fast local thresholding
+	// (each row of statistics is used for all parameters while in cache)
+	if ((Mode == OUT_BINARY || Mode == OUT_THRESHOLD) && !precisionCheck)
+	{
+		// Vectorized kernel
+		vector<sauvola_kernel> kernels = sauvolaKernels(params);
+		return runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
 		{
-			fprintf(stderr, "%s: image is too big after prescaling.\n", filename_in);
-			return 1;
-		}
-		int nw = preScale * w;
-		int nh = preScale * h;
-		if (nw == 0 || nh == 0)
+			for (size_t i = 0; i < n; i++)
+				sauvola_row(dst[i].ptr<unsigned char>(y), p, sum1, sum2, w, kernels[i], Mode == OUT_BINARY);
+		});
+	}
+	if (Mode == OUT_BINARY || Mode == OUT_THRESHOLD)
+	{
+		// Same with each row compared with double precision
+		vector<sauvola_kernel> kernels = sauvolaKernels(params);
+		for (sauvola_params& p : params)
+			p.precision = SAUVOLA_PRECISION_DOUBLE;
+		vector<sauvola_kernel> refKernels = sauvolaKernels(params);
+		vector<long> rowDiffer(in.rows);
+		bool ok = runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
 		{
-			fprintf(stderr, "%s: image is empty after prescaling.\n", filename_in);
-			return 1;
+			vector<unsigned char> ref(w);
+			for (size_t i = 0; i < n; i++)
+			{
+				unsigned char* d = dst[i].ptr<unsigned char>(y);
+				sauvola_row(d, p, sum1, sum2, w, kernels[i], Mode == OUT_BINARY);
+				sauvola_row(ref.data(), p, sum1, sum2, w, refKernels[i], Mode == OUT_BINARY);
+				for (int x = 0; x < w; x++)
+					if (d[x] != ref[x])
+						rowDiffer[y]++;
+			}
+		});
+		if (!ok)
+			return false;
+		long differ = 0;
+		for (long d : rowDiffer)
+			differ += d;
+		fprintf(stderr, "%s: precision check: %ld pixels (%.4f%%) differ from double precision.\n",
+			filename_in, differ, 100.0 * differ / (double(w) * in.rows * n));
+		return true;
+	}
+	return runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			double mean = sum1[x] * invsqWindow;
+			double var  = sum2[x] * invsqWindow - mean * mean;
+			if (Mode == OUT_PIXELINFO)
+			{
+				// BGR: mean, standard deviation * 2, inverted intensity
+				unsigned char* q = realdst.ptr<unsigned char>(y) + 3 * x;
+				q[0] = (unsigned char)mean;
+				q[1] = (unsigned char)(sqrt(var) * 2.0);
+				q[2] = 255 - p[x];
+			}
+			else
+			{
+				for (size_t i = 0; i < n; i++)
+					dst[i].ptr<unsigned char>(y)[x] = variableThreshold(p[x], mean, var, params[i]);
+			}
 		}
-		if (numeric_limits<int>::max() / nw < nh) // nw * nh > numeric_limits<int>::max()
+	});
+}
+
+/*
+	Grid points along an axis of n pixels (every step pixels and the last one)
+	and position of each pixel between them.
+*/
+struct GridAxis
+{
+	vector<int>    points;
+	vector<int>    index0; // grid points surrounding each pixel
+	vector<int>    index1;
+	vector<double> weight; // relative position from index0 to index1
+};
+
+static GridAxis gridAxis(int n, int step)
+{
+	GridAxis a;
+	for (int i = 0; i < n; i += step)
+		a.points.push_back(i);
+	if (a.points.back() != n - 1)
+		a.points.push_back(n - 1);
+	int last = a.points.size() - 1;
+	a.index0.resize(n);
+	a.index1.resize(n);
+	a.weight.resize(n);
+	int i = 0;
+	for (int x = 0; x < n; x++)
+	{
+		while (i + 1 < last && a.points[i + 1] <= x)
+			i++;
+		a.index0[x] = i;
+		a.index1[x] = min(i + 1, last);
+		a.weight[x] = a.index0[x] == a.index1[x] ? 0.0
+			: double(x - a.points[i]) / (a.points[i + 1] - a.points[i]);
+	}
+	return a;
+}
+
+/*
+	Approximate local thresholding for large windows:
+	the threshold surface is smooth enough to be evaluated only on grid points
+	(gridStep pixels apart) and bilinearly interpolated in between.
+	Only window sums of grid points are computed (see localstat_points, for any
+	ENGINE), unless sums of all pixels are needed for --grid-check, --tile or
+	the statistics cache.
+*/
+template <ProgramMode Mode, typename T>
+static bool binarizeGrid(vector<Mat>& dst, const InputImage& in, int wsize)
+{
+	const Mat& img = in.img;
+	int w = img.cols;
+	int h = img.rows;
+	size_t n = thresholdParams.size();
+	vector<sauvola_params> params(n);
+	for (size_t i = 0; i < n; i++)
+		params[i] = sauvolaParams(thresholdParams[i], wsize);
+	GridAxis gx = gridAxis(w, gridStep);
+	GridAxis gy = gridAxis(h, gridStep);
+	size_t gw = gx.points.size();
+	size_t gh = gy.points.size();
+	vector<int> gridRow(h, -1);
+	for (size_t j = 0; j < gh; j++)
+		gridRow[gy.points[j]] = j;
+	// Exact thresholds on the grid (and on all pixels if checked)
+	vector<vector<double>> grid(n, vector<double>(gw * gh));
+	vector<vector<double>> exact;
+	if (gridCheck)
+		exact.assign(n, vector<double>(size_t(w) * h));
+	auto gridPoint = [&](size_t j, size_t g, T sum1, T sum2)
+	{
+		for (size_t i = 0; i < n; i++)
 		{
-			fprintf(stderr, "%s: image is too big after prescaling.\n", filename_in);
-			return 1;
+			const sauvola_params& p = params[i];
+			double mean = sum1 * p.invsqWindow;
+			grid[i][gw * j + g] = sauvola_threshold(mean, sum2 * p.invsqWindow - mean * mean, p);
 		}
-		if (w != nw || h != nh)
+	};
+	bool ok;
+	if (!gridCheck && !tileRows && !statsCacheFile)
+	{
+		// Window sums on grid points only
+		localstat_points<T> e;
+		ok = e.prepare(img, wsize, gy.points, gx.points, threads);
+		if (ok)
 		{
-			resize(img, img, Size(nw, nh), 0, 0, INTER_LANCZOS4);
-			w = nw;
-			h = nh;
+			localstat_parallel(threads, gh, [&](int j0, int j1)
+			{
+				for (int j = j0; j < j1; j++)
+				{
+					for (size_t g = 0; g < gw; g++)
+					{
+						T sum1, sum2;
+						e.at(j, g, sum1, sum2);
+						gridPoint(j, g, sum1, sum2);
+					}
+				}
+			});
 		}
 	}
-
-	// Check padded image size
-	if (
-		numeric_limits<int>::max() - windowSize < w ||
-		numeric_limits<int>::max() - windowSize < h ||
-		numeric_limits<int>::max() / (w + windowSize) < h + windowSize
-	)
+	else
 	{
-		fprintf(stderr, "%s: image size plus window size is too big to pad.\n", filename_in);
-		return 1;
+		// Window sums of all pixels (checked, tiled or cached statistics)
+		ok = runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char*, const T* sum1, const T* sum2)
+		{
+			int j = gridRow[y];
+			if (j >= 0)
+				for (size_t g = 0; g < gw; g++)
+					gridPoint(j, g, sum1[gx.points[g]], sum2[gx.points[g]]);
+			for (size_t i = 0; gridCheck && i < n; i++)
+			{
+				const sauvola_params& p = params[i];
+				double* e = &exact[i][size_t(w) * y];
+				for (int x = 0; x < w; x++)
+				{
+					double mean = sum1[x] * p.invsqWindow;
+					e[x] = sauvola_threshold(mean, sum2[x] * p.invsqWindow - mean * mean, p);
+				}
+			}
+		});
 	}
+	if (!ok)
+		return false;
+	// Interpolation (and comparison with exact thresholds)
+	vector<double> rowDeviation(gridCheck ? h : 0);
+	vector<long>   rowFlipped(gridCheck ? h : 0);
+	localstat_parallel(threads, h, [&](int y0, int y1)
+	{
+		vector<double> row(gw);
+		vector<double> th(w);
+		vector<unsigned char> gray(img.channels() == 1 ? 0 : w);
+		for (int y = y0; y < y1; y++)
+		{
+			const unsigned char* p = localstat_row(img, y, gray.data());
+			double fy = gy.weight[y];
+			for (size_t i = 0; i < n; i++)
+			{
+				// Vertically, then horizontally
+				const double* g0 = &grid[i][gw * gy.index0[y]];
+				const double* g1 = &grid[i][gw * gy.index1[y]];
+				for (size_t g = 0; g < gw; g++)
+					row[g] = g0[g] + fy * (g1[g] - g0[g]);
+				th[w - 1] = row[gw - 1];
+				for (size_t g = 0; g + 1 < gw; g++)
+				{
+					int x0 = gx.points[g];
+					int x1 = gx.points[g + 1];
+					double t0 = row[g];
+					double slope = (row[g + 1] - t0) / (x1 - x0);
+					for (int x = x0; x < x1; x++)
+						th[x] = t0 + (x - x0) * slope;
+				}
+				unsigned char* d = dst[i].ptr<unsigned char>(y);
+				for (int x = 0; x < w; x++)
+				{
+					int threshold = th[x];
+					if (Mode == OUT_BINARY)
+						d[x] = p[x] > threshold ? 255 : 0;
+					else
+						d[x] = threshold;
+				}
+				if (gridCheck)
+				{
+					const double* e = &exact[i][size_t(w) * y];
+					for (int x = 0; x < w; x++)
+					{
+						rowDeviation[y] = max(rowDeviation[y], fabs(th[x] - e[x]));
+						if ((p[x] > int(th[x])) != (p[x] > int(e[x])))
+							rowFlipped[y]++;
+					}
+				}
+			}
+		}
+	});
+	if (gridCheck)
+	{
+		double deviation = *max_element(rowDeviation.begin(), rowDeviation.end());
+		long flipped = 0;
+		for (long f : rowFlipped)
+			flipped += f;
+		fprintf(stderr, "%s: grid step %d: maximum threshold deviation %.4f, %ld pixels (%.4f%%) flipped.\n",
+			filename_in, gridStep, deviation, flipped, 100.0 * flipped / (double(w) * h * n));
+	}
+	return true;
+}
 
-	// Supplementary parameters
-	double rParam = rScale * (255.0 * 0.5);
-	double tRealBias = 255.0 * tBias;
-	bool oVariable(programMode == OUT_VARIABLE || programMode == OUT_VARIABLE_MULTIW);
+/*
+	Wolf and Jolion (2004):
+	T = (1 - k) * m + k * M + k * s / R * (m - M)
+	where M is the minimum intensity and R is the maximum local standard
+	deviation of the page (scaled by RSCALE). Both are collected while the
+	window sums are computed, and the sums are kept so that the thresholds
+	can be computed afterwards without another statistics pass.
+*/
+template <ProgramMode Mode, typename T>
+static bool binarizeWolf(vector<Mat>& dst, const InputImage& in, int wsize)
+{
+	int w = in.cols;
+	int h = in.rows;
+	size_t n = thresholdParams.size();
+	double invsqWindow = 1.0 / wsize / wsize;
+	// Rows resampled or converted on demand are kept as well
+	Mat img = rowsOnDemand(in) ? Mat(h, w, CV_8U) : in.img;
+	vector<T> sums1(size_t(w) * h);
+	vector<T> sums2(size_t(w) * h);
+	vector<unsigned char> rowMin(h);
+	vector<double> rowMaxVariance(h);
+	bool ok = runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
+	{
+		copy(sum1, sum1 + w, sums1.begin() + size_t(w) * y);
+		copy(sum2, sum2 + w, sums2.begin() + size_t(w) * y);
+		if (rowsOnDemand(in))
+			copy(p, p + w, img.ptr<unsigned char>(y));
+		double maxVariance = 0;
+		for (int x = 0; x < w; x++)
+		{
+			double mean = sum1[x] * invsqWindow;
+			maxVariance = max(maxVariance, sum2[x] * invsqWindow - mean * mean);
+		}
+		rowMin[y] = *min_element(p, p + w);
+		rowMaxVariance[y] = maxVariance;
+	});
+	if (!ok)
+		return false;
+	double minValue  = *min_element(rowMin.begin(), rowMin.end());
+	double maxStddev = sqrt(*max_element(rowMaxVariance.begin(), rowMaxVariance.end()));
+	localstat_parallel(threads, h, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			const unsigned char* p = img.ptr<unsigned char>(y);
+			const T* sum1 = sums1.data() + size_t(w) * y;
+			const T* sum2 = sums2.data() + size_t(w) * y;
+			for (size_t i = 0; i < n; i++)
+			{
+				const ThresholdParams& tp = thresholdParams[i];
+				double k = tp.kParam;
+				double rParam = tp.rScale * maxStddev;
+				double tRealBias = 255.0 * tp.tBias;
+				unsigned char* d = dst[i].ptr<unsigned char>(y);
+				for (int x = 0; x < w; x++)
+				{
+					double mean   = sum1[x] * invsqWindow;
+					double stddev = sqrt(sum2[x] * invsqWindow - mean * mean);
+					double contrast = rParam > 0 ? stddev / rParam : 0.0;
+					int threshold = tp.tScale * ((1 - k) * mean + k * minValue + k * contrast * (mean - minValue)) + tRealBias;
+					if (Mode == OUT_BINARY)
+						d[x] = p[x] > threshold ? 255 : 0;
+					else
+						d[x] = threshold;
+				}
+			}
+		}
+	});
+	return true;
+}
 
-	// Iterate over window sizes
-	Mat realdst;
-	if (programMode == OUT_PIXELINFO || programMode == OUT_VARIABLE_MULTIW)
-		realdst = Mat(h, w, CV_8UC3);
-	for (size_t c = 0; c < multiWindowSize.size(); c++)
-	{
-		int wsize = multiWindowSize[c];
-		int win_n = wsize / 2;
-		int win_p = wsize / 2;
-		if ((wsize % 2) != 0)
-			++win_n;
-		int pw = w + wsize;
-		int ph = h + wsize;
-		double invsqWindow = 1.0 / wsize / wsize;
-		Mat dst(h, w, CV_8U);
-		Mat padimg;
-		copyMakeBorder(img, padimg, win_n, win_p, win_n, win_p, BORDER_REPLICATE);
-		// Make two integral images
-		intimage_type* buffer1 = new intimage_type[pw * ph];
-		intimage_type* buffer2 = new intimage_type[pw * ph];
-		{
-			intimage_type accum1 = 0;
-			intimage_type accum2 = 0;
-			for (int x = 0; x < pw; x++)
+/*
+	Bradley and Roth (2007):
+	T = m * (1 - k)
+	Only local means are needed, so a single integral image (of values) is
+	built instead of two.
+	(uint_least32_t requires wsize <= meanWindowSizeLimit32)
+*/
+template <ProgramMode Mode, typename T>
+static bool binarizeBradley(vector<Mat>& dst, const InputImage& in, int wsize)
+{
+	const Mat& img = in.img;
+	int w = img.cols;
+	size_t n = thresholdParams.size();
+	double invsqWindow = 1.0 / wsize / wsize;
+	return localstat_run_mean<T>(img, wsize, [&](int y, const T* sum1)
+	{
+		vector<unsigned char> gray(img.channels() == 1 ? 0 : w);
+		const unsigned char* p = localstat_row(img, y, gray.data());
+		for (size_t i = 0; i < n; i++)
+		{
+			const ThresholdParams& tp = thresholdParams[i];
+			double k = tp.kParam;
+			double tRealBias = 255.0 * tp.tBias;
+			unsigned char* d = dst[i].ptr<unsigned char>(y);
+			for (int x = 0; x < w; x++)
 			{
-				intimage_type value = padimg.at<unsigned char>(0, x);
-				accum1 += value;
-				accum2 += value * value;
-				buffer1[x] = accum1;
-				buffer2[x] = accum2;
+				double mean = sum1[x] * invsqWindow;
+				int threshold = tp.tScale * mean * (1 - k) + tRealBias;
+				if (Mode == OUT_BINARY)
+					d[x] = p[x] > threshold ? 255 : 0;
+				else
+					d[x] = threshold;
 			}
 		}
-		for (int y = 1; y < ph; y++)
+	}, threads);
+}
+
+/*
+	Image reduced by half (2x2 box averages, rounded)
+	with the last row and column replicated on odd sizes
+*/
+static Mat reduceHalf(const Mat& src)
+{
+	int w = src.cols;
+	int h = src.rows;
+	int rw = (w + 1) / 2;
+	int rh = (h + 1) / 2;
+	Mat dst(rh, rw, CV_8U);
+	localstat_parallel(threads, rh, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
 		{
-			intimage_type accum1 = 0;
-			intimage_type accum2 = 0;
-			for (int x = 0; x < pw; x++)
+			const unsigned char* s0 = src.ptr<unsigned char>(2 * y);
+			const unsigned char* s1 = src.ptr<unsigned char>(min(2 * y + 1, h - 1));
+			unsigned char* d = dst.ptr<unsigned char>(y);
+			for (int x = 0; x < rw; x++)
 			{
-				intimage_type value = padimg.at<unsigned char>(y, x);
-				accum1 += value;
-				accum2 += value * value;
-				buffer1[pw * y + x] = accum1 + buffer1[pw * (y - 1) + x];
-				buffer2[pw * y + x] = accum2 + buffer2[pw * (y - 1) + x];
+				int x0 = 2 * x;
+				int x1 = min(2 * x + 1, w - 1);
+				d[x] = (s0[x0] + s0[x1] + s1[x0] + s1[x1] + 2) >> 2;
 			}
 		}
-		// Fast Sauvola's algorithm
-		for (int y = 0; y < h; y++)
+	});
+	return dst;
+}
+
+/*
+	Lazzara and Geraud (2014), multiscale Sauvola's algorithm:
+	Level l is the image halved l times and binarized with the same window
+	size in its own pixels (covering 2^l times as wide part of the page).
+	Levels above 0 add up to 1/3 of the pixels, so the cost stays within a
+	constant factor of a single-scale run.
+	A black component of level l >= 1 is an object of that level if its area
+	(in pixels of level l) is in [W^2 / 16, W^2 / 4), without upper bound on
+	the coarsest level. Each pixel takes the threshold of the coarsest level
+	with an object covering it, or of level 0 if none (so level 0 only needs
+	binary decisions of the vectorized kernel).
+*/
+template <typename T>
+static bool binarizeMultiScale(vector<Mat>& dst, const InputImage& in, int wsize)
+{
+	int w = in.cols;
+	int h = in.rows;
+	int levels = multiScaleLevels;
+	size_t n = thresholdParams.size();
+	vector<sauvola_params> params(n);
+	for (size_t i = 0; i < n; i++)
+		params[i] = sauvolaParams(thresholdParams[i], wsize);
+	vector<sauvola_kernel> kernels = sauvolaKernels(params);
+	// Level 0 (rows resampled or converted on demand are kept as well)
+	Mat img = rowsOnDemand(in) ? Mat(h, w, CV_8U) : in.img;
+	bool ok = runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
+	{
+		if (rowsOnDemand(in))
+			copy(p, p + w, img.ptr<unsigned char>(y));
+		for (size_t i = 0; i < n; i++)
+			sauvola_row(dst[i].ptr<unsigned char>(y), p, sum1, sum2, w, kernels[i], true);
+	});
+	if (!ok)
+		return false;
+	// Thresholds of levels >= 1 (clamped to [-1, 255])
+	vector<Mat> images(levels);
+	vector<vector<Mat>> thresholds(levels, vector<Mat>(n));
+	images[0] = img;
+	for (int l = 1; l < levels; l++)
+	{
+		const Mat& li = images[l] = reduceHalf(images[l - 1]);
+		for (size_t i = 0; i < n; i++)
+			thresholds[l][i] = Mat(li.rows, li.cols, CV_16S);
+		ok = localstat_run<T>(engine, li, wsize, [&](int y, const T* sum1, const T* sum2)
 		{
-			int Y0 = pw * y;
-			int Y1 = pw * (y + wsize);
-			for (int x = 0; x < w; x++)
+			for (size_t i = 0; i < n; i++)
 			{
-				intimage_type total1 =
-					buffer1[Y1 + (x + wsize)] -
-					buffer1[Y1 + x] +
-					buffer1[Y0 + x] -
-					buffer1[Y0 + (x + wsize)];
-				intimage_type total2 =
-					buffer2[Y1 + (x + wsize)] -
-					buffer2[Y1 + x] +
-					buffer2[Y0 + x] -
-					buffer2[Y0 + (x + wsize)];
-				double mean   = total1 * invsqWindow;
-				double stddev = sqrt(total2 * invsqWindow - mean * mean);
-				if (programMode == OUT_PIXELINFO)
-				{
-					auto chI = 255 - padimg.at<unsigned char>(y + win_n, x + win_n);
-					auto chD = stddev * 2.0;
-					auto chM = mean;
-					realdst.at<Vec3b>(y, x) = Vec3b(chM, chD, chI);
-				}
-				if (oVariable)
+				const sauvola_params& p = params[i];
+				short* t = thresholds[l][i].ptr<short>(y);
+				for (int x = 0; x < li.cols; x++)
 				{
-					/*
-						Variable Threshold Image:
-						In Sauvola's algorithm, increasing K makes some black pixels white.
-						The intensity of each pixel in this mode is determined by
-						the lowest K value (Kt) which makes given pixel white.
-						White: Kt == 0, Black: Kt >= 1
-					*/
-					double th1 = tScale * mean;
-					double th0 = th1 * (1 + (stddev / rParam - 1));
-					th0 += tRealBias; th1 += tRealBias;
-					// th0 <= th1 while rScale >= 1.0.
-					double v = padimg.at<unsigned char>(y + win_n, x + win_n);
-					v = max(min(v, th1), th0);
-					dst.at<unsigned char>(y, x) = 255.0 * (v - th0) / (th1 - th0);
+					double mean = sum1[x] * p.invsqWindow;
+					int threshold = sauvola_threshold(mean, sum2[x] * p.invsqWindow - mean * mean, p);
+					t[x] = max(-1, min(threshold, 255));
 				}
-				else
+			}
+		}, threads);
+		if (!ok)
+			return false;
+	}
+	long areaMin = long(wsize) * wsize / 16;
+	long areaMax = long(wsize) * wsize / 4;
+	for (size_t i = 0; i < n; i++)
+	{
+		// Selected level of each pixel (from the coarsest level to level 1)
+		Mat scale;
+		for (int l = levels - 1; l >= 1; l--)
+		{
+			const Mat& li = images[l];
+			Mat objects(li.rows, li.cols, CV_8U);
+			for (int y = 0; y < li.rows; y++)
+			{
+				const unsigned char* p = li.ptr<unsigned char>(y);
+				const short* t = thresholds[l][i].ptr<short>(y);
+				unsigned char* o = objects.ptr<unsigned char>(y);
+				for (int x = 0; x < li.cols; x++)
+					o[x] = p[x] > t[x] ? 0 : 255;
+			}
+			Mat labels, stats, centroids;
+			int nlabels = connectedComponentsWithStats(objects, labels, stats, centroids, 8, CV_32S);
+			vector<bool> selected(nlabels, false);
+			for (int j = 1; j < nlabels; j++)
+			{
+				long area = stats.at<int>(j, CC_STAT_AREA);
+				selected[j] = area >= areaMin && (l == levels - 1 || area < areaMax);
+			}
+			Mat next(li.rows, li.cols, CV_8U);
+			for (int y = 0; y < li.rows; y++)
+			{
+				const unsigned char* c = scale.empty() ? nullptr : scale.ptr<unsigned char>(y / 2);
+				const int* label = labels.ptr<int>(y);
+				unsigned char* d = next.ptr<unsigned char>(y);
+				for (int x = 0; x < li.cols; x++)
+					d[x] = c && c[x / 2] ? c[x / 2] : selected[label[x]] ? l : 0;
+			}
+			scale = next;
+		}
+		if (scale.empty())
+			continue;
+		// Pixels taking thresholds of levels >= 1
+		localstat_parallel(threads, h, [&](int y0, int y1)
+		{
+			for (int y = y0; y < y1; y++)
+			{
+				const unsigned char* p = img.ptr<unsigned char>(y);
+				const unsigned char* c = scale.ptr<unsigned char>(y / 2);
+				unsigned char* d = dst[i].ptr<unsigned char>(y);
+				for (int x = 0; x < w; x++)
 				{
-					int threshold = tScale * mean * (1 + kParam * (stddev / rParam - 1)) + tRealBias;
-					if (programMode == OUT_THRESHOLD)
-						dst.at<unsigned char>(y, x) = threshold;
-					else
-						dst.at<unsigned char>(y, x) = padimg.at<unsigned char>(y + win_n, x + win_n) > threshold ? 255 : 0;
+					int l = c[x / 2];
+					if (l)
+						d[x] = p[x] > thresholds[l][i].ptr<short>(y >> l)[x >> l] ? 255 : 0;
 				}
 			}
+		});
+	}
+	return true;
+}
+
+/*
+	Automatic K (-k auto) of Sauvola's algorithm:
+	With A = tScale * mean + tRealBias and
+	B = tScale * mean * (stddev / rParam - 1), the threshold is A + K * B
+	and a pixel v stays black up to Kt = (v - A) / B (B < 0), which is what
+	the variable threshold image shows. A histogram of Kt, built while
+	window sums are computed, therefore gives the binarization for every K
+	at once. K is chosen by Otsu's criterion on it, separating background
+	pixels slightly darker than their surroundings (small Kt) from ink, so
+	that faded ink gets smaller K. Thresholds are then computed from the
+	window sums kept from the statistics pass (with the same kernel as a
+	given K).
+*/
+template <ProgramMode Mode, typename T>
+static bool binarizeAutoK(vector<Mat>& dst, const InputImage& in, int wsize)
+{
+	int w = in.cols;
+	int h = in.rows;
+	size_t n = thresholdParams.size();
+	vector<sauvola_params> params(n);
+	for (size_t i = 0; i < n; i++)
+		params[i] = sauvolaParams(thresholdParams[i], wsize);
+	double invsqWindow = params[0].invsqWindow;
+	// Rows resampled or converted on demand are kept as well
+	Mat img = rowsOnDemand(in) ? Mat(h, w, CV_8U) : in.img;
+	vector<T> sums1(size_t(w) * h);
+	vector<T> sums2(size_t(w) * h);
+	vector<vector<long>> hist(n, vector<long>(autoKBins));
+	mutex histLock;
+	bool ok = runStatistics<T>(in, vector<int>(1, wsize), [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
+	{
+		copy(sum1, sum1 + w, sums1.begin() + size_t(w) * y);
+		copy(sum2, sum2 + w, sums2.begin() + size_t(w) * y);
+		if (rowsOnDemand(in))
+			copy(p, p + w, img.ptr<unsigned char>(y));
+		vector<long> rowHist(n * autoKBins);
+		for (int x = 0; x < w; x++)
+		{
+			double mean   = sum1[x] * invsqWindow;
+			double stddev = sqrt(sum2[x] * invsqWindow - mean * mean);
+			for (size_t i = 0; i < n; i++)
+			{
+				const sauvola_params& sp = params[i];
+				double A = sp.tScale * mean + sp.tRealBias;
+				double B = sp.tScale * mean * (stddev / sp.rParam - 1);
+				// Pixels not depending on K (or NaN) are left out
+				if (!(B < 0))
+					continue;
+				double kt = (p[x] - A) / B;
+				int bin = kt <= 0 ? 0 : kt >= 1 ? autoKBins - 1 : int(kt * autoKBins);
+				rowHist[i * autoKBins + bin]++;
+			}
 		}
-		// Finalization
-		delete[] buffer1;
-		delete[] buffer2;
-		if (programMode == OUT_VARIABLE_MULTIW)
+		lock_guard<mutex> lock(histLock);
+		for (size_t i = 0; i < n; i++)
+			for (int b = 0; b < autoKBins; b++)
+				hist[i][b] += rowHist[i * autoKBins + b];
+	});
+	if (!ok)
+		return false;
+	for (size_t i = 0; i < n; i++)
+	{
+		// Otsu's criterion (black: bins >= t) except for the first bin
+		// (pixels not darker than the threshold for K = 0 stay white anyway)
+		double total = 0, sum = 0;
+		for (int b = 1; b < autoKBins; b++)
+		{
+			total += hist[i][b];
+			sum   += double(b) * hist[i][b];
+		}
+		double wB = 0, sumB = 0, best = 0;
+		int bestT = 0;
+		for (int t = 2; t < autoKBins; t++)
 		{
-			// Copy temporary image to a channel of output image
-			size_t d = c + 1;
-			if (d == multiWindowSize.size())
-				d = 3;
-			for (size_t k = c; k < d; k++)
+			wB   += hist[i][t - 1];
+			sumB += double(t - 1) * hist[i][t - 1];
+			double wF = total - wB;
+			if (wB == 0)
+				continue;
+			if (wF == 0)
+				break;
+			double d = sumB / wB - (sum - sumB) / wF;
+			double between = wB * wF * d * d;
+			if (between > best)
 			{
-				size_t realch = 2 - k;
-				for (int y = 0; y < h; y++)
-					for (int x = 0; x < w; x++)
-						realdst.at<Vec3b>(y, x)[realch] = dst.at<unsigned char>(y, x);
+				best  = between;
+				bestT = t;
 			}
 		}
-		else if (programMode != OUT_PIXELINFO)
-			realdst = dst;
+		double k = bestT ? double(bestT) / autoKBins : defaultKParam;
+		params[i].kParam = thresholdParams[i].kParam = k;
+		fprintf(stderr, "%s: automatic k parameter %g.\n", filename_in, k);
+	}
+	vector<sauvola_kernel> kernels = sauvolaKernels(params);
+	localstat_parallel(threads, h, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			const unsigned char* p = img.ptr<unsigned char>(y);
+			const T* sum1 = sums1.data() + size_t(w) * y;
+			const T* sum2 = sums2.data() + size_t(w) * y;
+			for (size_t i = 0; i < n; i++)
+				sauvola_row(dst[i].ptr<unsigned char>(y), p, sum1, sum2, w, kernels[i], Mode == OUT_BINARY);
+		}
+	});
+	return true;
+}
+
+/*
+	T: type of integral images
+	(uint_least32_t requires wsize <= windowSizeLimit32)
+*/
+template <typename T>
+static bool binarizeWithWindow(vector<Mat>& dst, Mat& realdst, const InputImage& in, int wsize)
+{
+	if (method == METHOD_BRADLEY)
+	{
+		if (programMode == OUT_BINARY)
+			return binarizeBradley<OUT_BINARY, T>(dst, in, wsize);
+		return binarizeBradley<OUT_THRESHOLD, T>(dst, in, wsize);
+	}
+	if (method == METHOD_WOLF)
+	{
+		if (programMode == OUT_BINARY)
+			return binarizeWolf<OUT_BINARY, T>(dst, in, wsize);
+		return binarizeWolf<OUT_THRESHOLD, T>(dst, in, wsize);
+	}
+	if (autoK)
+	{
+		if (programMode == OUT_BINARY)
+			return binarizeAutoK<OUT_BINARY, T>(dst, in, wsize);
+		return binarizeAutoK<OUT_THRESHOLD, T>(dst, in, wsize);
+	}
+	if (multiScaleLevels)
+		return binarizeMultiScale<T>(dst, in, wsize);
+	if (gridStep)
+	{
+		if (programMode == OUT_BINARY)
+			return binarizeGrid<OUT_BINARY, T>(dst, in, wsize);
+		return binarizeGrid<OUT_THRESHOLD, T>(dst, in, wsize);
 	}
+	switch (programMode)
+	{
+		case OUT_BINARY:
+			return binarizeKernel<OUT_BINARY, T>(dst, realdst, in, wsize);
+		case OUT_THRESHOLD:
+			return binarizeKernel<OUT_THRESHOLD, T>(dst, realdst, in, wsize);
+		case OUT_PIXELINFO:
+			return binarizeKernel<OUT_PIXELINFO, T>(dst, realdst, in, wsize);
+		default:
+			return binarizeKernel<OUT_VARIABLE, T>(dst, realdst, in, wsize);
+	}
+}
+
+/*
+	Variable threshold image for all window sizes in a single sweep
+	(integral images are shared among window sizes, and statistics and
+	thresholds are computed once for each distinct window size).
+	RGB mapping: R=W1, G=W2, B=W3
+*/
+template <typename T>
+static bool binarizeMultiWindow(Mat& realdst, const InputImage& in)
+{
+	int w = in.cols;
+	size_t n = statWindowSize.size();
+	vector<sauvola_params> params(n);
+	for (size_t j = 0; j < n; j++)
+		params[j] = sauvolaParams(thresholdParams[0], statWindowSize[j]);
+	// Channel (BGR) to statistics
+	size_t index[3];
+	for (size_t c = 0; c < 3; c++)
+		index[2 - c] = find(statWindowSize.begin(), statWindowSize.end(), multiWindowSize[c]) - statWindowSize.begin();
+	return runStatistics<T>(in, statWindowSize, [&](int y, const unsigned char* p, const T* sum1, const T* sum2)
+	{
+		unsigned char* q = realdst.ptr<unsigned char>(y);
+		unsigned char v[3];
+		for (int x = 0; x < w; x++)
+		{
+			for (size_t j = 0; j < n; j++)
+			{
+				double mean = sum1[size_t(w) * j + x] * params[j].invsqWindow;
+				double var  = sum2[size_t(w) * j + x] * params[j].invsqWindow - mean * mean;
+				v[j] = variableThreshold(p[x], mean, var, params[j]);
+			}
+			q[3 * x    ] = v[index[0]];
+			q[3 * x + 1] = v[index[1]];
+			q[3 * x + 2] = v[index[2]];
+		}
+	});
+}
+
+
+
+static void writeImage(const char* filename, const Mat& img)
+{
 	vector<int> params;
 	if (programMode == OUT_BINARY)
 	{
-		string fn(filename_out);
+		string fn(filename);
 		if (fn.size() >= 4 && fn.substr(fn.size() - 4) == ".png")
 		{
 			params.push_back(IMWRITE_PNG_COMPRESSION);
@@ -461,6 +1490,199 @@ int main(int argc, char** argv)
 			params.push_back(IMWRITE_PNG_BILEVEL);
 		}
 	}
-	imwrite(filename_out, realdst, params);
+	imwrite(filename, img, params);
+}
+
+// Shortest %g representation which reads back as the same value
+static string shortestDouble(double v)
+{
+	char buf[32];
+	for (int prec = 6; prec < 17; prec++)
+	{
+		snprintf(buf, sizeof(buf), "%.*g", prec, v);
+		if (strtod(buf, nullptr) == v)
+			return buf;
+	}
+	snprintf(buf, sizeof(buf), "%.17g", v);
+	return buf;
+}
+
+/*
+	Output filename for one of parameter combinations:
+	OUT-kK-rRSCALE-tT-bB.EXT
+	(distinct values always give distinct names)
+*/
+static string sweepFilename(const char* filename, const ThresholdParams& tp)
+{
+	string fn(filename);
+	size_t ext = fn.find_last_of('.');
+	size_t sep = fn.find_last_of('/');
+	if (ext == string::npos || (sep != string::npos && ext < sep))
+		ext = fn.size();
+	string suffix = "-k" + shortestDouble(tp.kParam) + "-r" + shortestDouble(tp.rScale)
+		+ "-t" + shortestDouble(tp.tScale) + "-b" + shortestDouble(tp.tBias);
+	return fn.substr(0, ext) + suffix + fn.substr(ext);
+}
+
+
+
+static bool loadImage(InputImage& in)
+{
+	Mat& img = in.img;
+	// With --color, colour images are kept in BGR and their luminance
+	// follows cvtColor (COLOR_BGR2GRAY), not the grayscale decoder
+	img = imread(filename_in, colorInput ? IMREAD_ANYCOLOR : IMREAD_GRAYSCALE);
+	if (!img.data)
+	{
+		fprintf(stderr, "%s: image could not be loaded.\n", filename_in);
+		return false;
+	}
+	if (img.empty())
+	{
+		fprintf(stderr, "%s: image is empty.\n", filename_in);
+		return false;
+	}
+	int w = img.cols;
+	int h = img.rows;
+
+	// Resize image if necessary
+	if (preScale != 1.0)
+	{
+		if (preScale * w + 1 >= numeric_limits<int>::max() || preScale * h + 1 >= numeric_limits<int>::max())
+		{
+			fprintf(stderr, "%s: image is too big after prescaling.\n", filename_in);
+			return false;
+		}
+		int nw = preScale * w;
+		int nh = preScale * h;
+		if (nw == 0 || nh == 0)
+		{
+			fprintf(stderr, "%s: image is empty after prescaling.\n", filename_in);
+			return false;
+		}
+		if (w != nw || h != nh)
+		{
+			// Lanczos4 resampling works on grayscale images
+			if (img.channels() != 1)
+				cvtColor(img, img, COLOR_BGR2GRAY);
+			if (fusedPrescale)
+				in.prescaler.reset(new resample_lanczos4(img, nw, nh));
+			else
+				resize(img, img, Size(nw, nh), 0, 0, INTER_LANCZOS4);
+		}
+		w = nw;
+		h = nh;
+	}
+	in.cols = w;
+	in.rows = h;
+	return true;
+}
+
+
+
+static bool statsCacheKey(statcache_key& key, bool narrow)
+{
+	memset(&key, 0, sizeof(key));
+	if (!statcache_hash_file(filename_in, key.input_hash, key.input_size))
+		return false;
+	key.prescale = preScale;
+	key.sum_bits = narrow ? 32 : 64;
+	key.nwindows = statWindowSize.size();
+	copy(statWindowSize.begin(), statWindowSize.end(), key.windows);
+	key.decode = colorInput ? STATCACHE_DECODE_COLOR : STATCACHE_DECODE_GRAYSCALE;
+	return true;
+}
+
+
+
+int main(int argc, char** argv)
+{
+	argparse(argc, argv);
+	sauvola_set_simd(simd);
+
+	// Use the narrowest integral images which give exact window sums
+	// (windowSize is the largest one on multi-window mode)
+	bool narrow = integralBits == 32 || (integralBits == 0 &&
+		windowSize <= (method == METHOD_BRADLEY ? meanWindowSizeLimit32 : windowSizeLimit32));
+
+	// Reuse local statistics (and prescaled image) if cached
+	InputImage in;
+	Mat& img = in.img;
+	statcache_key key;
+	if (statsCacheFile)
+	{
+		if (!statsCacheKey(key, narrow))
+		{
+			fprintf(stderr, "%s: image could not be loaded.\n", filename_in);
+			return 1;
+		}
+		if (statsCache.open(statsCacheFile, key))
+		{
+			statsCached = true;
+			img = Mat(statsCache.height(), statsCache.width(), CV_8U, statsCache.image());
+			in.cols = img.cols;
+			in.rows = img.rows;
+		}
+	}
+	if (!statsCached)
+	{
+		if (!loadImage(in))
+			return 1;
+		if (statsCacheFile)
+		{
+			if (statsCache.create(statsCacheFile, key, img.cols, img.rows))
+			{
+				Mat cached(img.rows, img.cols, CV_8U, statsCache.image());
+				if (img.channels() == 1)
+					img.copyTo(cached);
+				else
+				{
+					for (int y = 0; y < img.rows; y++)
+						localstat_row(img, y, cached.ptr<unsigned char>(y));
+					img = cached;
+				}
+			}
+			else
+				fprintf(stderr, "%s: statistics cache could not be created.\n", statsCacheFile);
+		}
+	}
+	int w = in.cols;
+	int h = in.rows;
+
+	bool ok;
+	Mat realdst;
+	vector<Mat> dst;
+	if (programMode == OUT_VARIABLE_MULTIW)
+	{
+		realdst = Mat(h, w, CV_8UC3);
+		ok = narrow
+			? binarizeMultiWindow<uint_least32_t>(realdst, in)
+			: binarizeMultiWindow<uint_least64_t>(realdst, in);
+	}
+	else
+	{
+		if (programMode == OUT_PIXELINFO)
+			realdst = Mat(h, w, CV_8UC3);
+		else
+			for (size_t i = 0; i < thresholdParams.size(); i++)
+				dst.push_back(Mat(h, w, CV_8U));
+		ok = narrow
+			? binarizeWithWindow<uint_least32_t>(dst, realdst, in, windowSize)
+			: binarizeWithWindow<uint_least64_t>(dst, realdst, in, windowSize);
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "%s: image size plus window size is too big to pad.\n", filename_in);
+		return 1;
+	}
+	if (!statsCached)
+		statsCache.commit();
+	if (dst.size() == 1)
+		realdst = dst[0];
+	if (!realdst.empty())
+		writeImage(filename_out, realdst);
+	else
+		for (size_t i = 0; i < dst.size(); i++)
+			writeImage(sweepFilename(filename_out, thresholdParams[i]).c_str(), dst[i]);
 	return 0;
 }
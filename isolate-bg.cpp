@@ -57,21 +57,19 @@
 #include <opencv2/imgproc.hpp>
 
 #include "microlib/argparse.hpp"
+#include "microlib/localstat.hpp"
+#include "microlib/sauvola.hpp"
 
 using namespace std;
 using namespace cv;
 
 
 
-#if 1
 // 16843009^2 * 255^2 < 2^64
 static const long integralWindowSizeLimit = 16843009;
-typedef uint_least64_t intimage_type;
-#else
 // 257^2 * 255^2 < 2^32
-static const long integralWindowSizeLimit = 257;
-typedef uint_least32_t intimage_type;
-#endif
+// (window sums stay exact even if 32-bit integral images wrap around)
+static const long integralWindowSizeLimit32 = 257;
 
 enum ProgramMode
 {
@@ -88,6 +86,9 @@ enum InpaintInitMode
 
 static const int    defaultIntegralWindowSize = 60;
 static const double defaultKParam = 0.4;
+static const double defaultNiblackKParam = -0.2;
+static const double defaultNickKParam = -0.1;
+static const double defaultPhansalkarKParam = 0.25;
 static_assert(defaultIntegralWindowSize <= integralWindowSizeLimit, "defaultIntegralWindowSize must not exceed integralWindowSizeLimit.");
 
 static const int defaultInpaintIterations = 16;
@@ -106,8 +107,13 @@ static bool inputAsGrayscale = false;
 static bool adjustBrightness = false;
 
 static int    integralWindowSize = defaultIntegralWindowSize;
+static sauvola_method method = SAUVOLA_METHOD_SAUVOLA;
 static double kParam   = defaultKParam;
 static double rScale   = 1.0;
+static localstat_engine engine = LOCALSTAT_ENGINE_INTEGRAL;
+static int integralBits = 0; // 0: auto
+static int threads = 1;
+static sauvola_precision precision = SAUVOLA_PRECISION_DOUBLE;
 
 static InpaintInitMode inpaintInitMode   = ISOBG_INPAINT_INIT_NEIGHBOR_L1;
 static int             inpaintIterations = defaultInpaintIterations;
@@ -124,7 +130,7 @@ static void usage(int argc, char** argv, int ret = 1)
 {
 	fprintf(stderr,
 		"usage: %s \\\n"
-		"      [-g] [-w WINDOW_SIZE] [-k K] [-r RSCALE] \\\n"
+		"      [-g] [--method METHOD] [-w WINDOW_SIZE] [-k K] [-r RSCALE] [-E ENGINE] [--threads THREADS] \\\n"
 		"      [-I IIMODE] [-i ITER] [-j DIST1] [-J DIST2] \\\n"
 		"      [-A BLUR] [-a ALPHA] \\\n"
 		"      [-B] [-G] IN OUT\n"
@@ -133,10 +139,27 @@ static void usage(int argc, char** argv, int ret = 1)
 		"   -h | --help      show this help\n"
 		"   -v | --version   show version information\n"
 		"   -g               input as grayscale image\n"
+		"   --method METHOD  set thresholding method to make the mask [sauvola]\n"
+		"                    (sauvola, niblack, nick or phansalkar)\n"
 		"   -w WINDOW_SIZE   set window size          [%d]\n"
 		"   -k K             set K parameter for Sauvola's algorithm     [%f]\n"
+		"                    (default for niblack: %f, nick: %f, phansalkar: %f;\n"
+		"                     negative values are allowed for niblack and nick)\n"
 		"   -r RSCALE        set scale of R parameter [1.0]\n"
 		"                    (1.0 for maximum standard deviation possible)\n"
+		"   -E ENGINE        set engine to compute local statistics [integral]\n"
+		"                    (integral: whole-page integral images, stream: rolling integral rows,\n"
+		"                     clamped: unpadded integral images, column: running column sums,\n"
+		"                     interleaved: whole-page integral images stored as sum pairs)\n"
+		"   --integral-bits BITS\n"
+		"                    set width of integral images (32, 64 or auto) [auto]\n"
+		"                    (32 requires WINDOW_SIZE <= %ld, auto uses 32 if possible)\n"
+		"   --threads THREADS\n"
+		"                    set number of threads to binarize image [1]\n"
+		"                    (0 for the number of CPUs)\n"
+		"   --precision PRECISION\n"
+		"                    set arithmetic of local thresholds (double or float) [double]\n"
+		"                    (float: faster with AVX2 and 32-bit integral images, same output)\n"
 		"   -I IIMODE        set background inpaint initialization mode\n"
 		"                    (mean: mean for whole unmasked image, neighbor: neighbor by L1)\n"
 		"   -i ITER          set inpaint iterations   [%d]\n"
@@ -147,7 +170,9 @@ static void usage(int argc, char** argv, int ret = 1)
 		"   -B               write background image instead of normalized image\n"
 		"   -G               adjust brightness of output image\n",
 		argv[0],
-		defaultIntegralWindowSize, defaultKParam, defaultInpaintIterations,
+		defaultIntegralWindowSize, defaultKParam,
+		defaultNiblackKParam, defaultNickKParam, defaultPhansalkarKParam,
+		integralWindowSizeLimit32, defaultInpaintIterations,
 		defaultMaskDenoiseDistance1, defaultMaskDenoiseDistance2,
 		defaultBackgroundBlur, defaultBackgroundAlpha);
 	exit(ret);
@@ -162,13 +187,40 @@ static void argparse(int argc, char** argv)
 		{ "neighbor-L1", ISOBG_INPAINT_INIT_NEIGHBOR_L1 },
 		{ "default",     ISOBG_INPAINT_INIT_NEIGHBOR_L1 },
 	};
+	unordered_map<string, localstat_engine> engines = {
+		{ "integral",  LOCALSTAT_ENGINE_INTEGRAL },
+		{ "default",   LOCALSTAT_ENGINE_INTEGRAL },
+		{ "stream",    LOCALSTAT_ENGINE_STREAM },
+		{ "streaming", LOCALSTAT_ENGINE_STREAM },
+		{ "clamped",       LOCALSTAT_ENGINE_CLAMPED },
+		{ "padding-free",  LOCALSTAT_ENGINE_CLAMPED },
+		{ "column",        LOCALSTAT_ENGINE_COLUMN },
+		{ "sliding",       LOCALSTAT_ENGINE_COLUMN },
+		{ "interleaved",   LOCALSTAT_ENGINE_INTERLEAVED },
+	};
+	unordered_map<string, sauvola_method> methods = {
+		{ "sauvola",    SAUVOLA_METHOD_SAUVOLA },
+		{ "niblack",    SAUVOLA_METHOD_NIBLACK },
+		{ "nick",       SAUVOLA_METHOD_NICK },
+		{ "phansalkar", SAUVOLA_METHOD_PHANSALKAR },
+	};
+	unordered_map<string, sauvola_precision> precisions = {
+		{ "double", SAUVOLA_PRECISION_DOUBLE },
+		{ "float",  SAUVOLA_PRECISION_FLOAT },
+		{ "single", SAUVOLA_PRECISION_FLOAT },
+	};
 	const struct option longopts[] = {
 		{ "help",               no_argument, 0, 'h' },
 		{ "version",            no_argument, 0, 'v' },
 		{ "input-as-grayscale", no_argument, 0, 'g' },
+		{ "method",             required_argument, 0, 'm' },
 		{ "window-size",        required_argument, 0, 'w' },
 		{ "k-param",            required_argument, 0, 'k' },
 		{ "r-scale",            required_argument, 0, 'r' },
+		{ "engine",             required_argument, 0, 'E' },
+		{ "integral-bits",      required_argument, 0, 'M' },
+		{ "threads",            required_argument, 0, 'T' },
+		{ "precision",          required_argument, 0, 'P' },
 		{ "inpaint-initmode",   required_argument, 0, 'I' },
 		{ "iteration",          required_argument, 0, 'i' },
 		{ "mask-denoise-dist1", required_argument, 0, 'j' },
@@ -178,10 +230,11 @@ static void argparse(int argc, char** argv)
 		{},
 	};
 	int opt, longindex;
+	bool kParamGiven = false;
 	try
 	{
 		opterr = 0;
-		while ((opt = getopt_long(argc, argv, ":hvgw:k:r:I:i:j:J:A:a:BG0123456789", longopts, &longindex)) != -1)
+		while ((opt = getopt_long(argc, argv, ":hvgw:k:r:E:I:i:j:J:A:a:BG0123456789", longopts, &longindex)) != -1)
 		{
 			switch (opt)
 			{
@@ -204,14 +257,44 @@ static void argparse(int argc, char** argv)
 					break;
 				case 'k':
 					kParam = argparse_double("-k", optarg, true);
-					if (kParam < 0)
-						throw argparse_error("-k", "k parameter is too small.");
+					kParamGiven = true;
 					break;
+				case 'm':
+				{
+					auto p = methods.find(optarg);
+					if (p == methods.end())
+						throw argparse_error("--method", "unknown value.");
+					method = p->second;
+				}; break;
 				case 'r':
 					rScale = argparse_double("-r", optarg, true);
 					if (rScale <= 0)
 						throw argparse_error("-r", "R scale must be positive.");
 					break;
+				case 'E':
+				{
+					auto p = engines.find(optarg);
+					if (p == engines.end())
+						throw argparse_error("-E", "unknown value.");
+					engine = p->second;
+				}; break;
+				case 'M':
+					integralBits = string(optarg) == "auto" ? 0 : argparse_int("--integral-bits", optarg);
+					if (integralBits != 0 && integralBits != 32 && integralBits != 64)
+						throw argparse_error("--integral-bits", "unknown value.");
+					break;
+				case 'T':
+					threads = argparse_int("--threads", optarg);
+					if (threads < 0)
+						throw argparse_error("--threads", "number of threads must not be negative.");
+					break;
+				case 'P':
+				{
+					auto p = precisions.find(optarg);
+					if (p == precisions.end())
+						throw argparse_error("--precision", "unknown value.");
+					precision = p->second;
+				}; break;
 				case 'I':
 				{
 					auto p = iimodes.find(optarg);
@@ -278,6 +361,20 @@ static void argparse(int argc, char** argv)
 					break;
 			}
 		}
+		if (!kParamGiven)
+		{
+			switch (method)
+			{
+				case SAUVOLA_METHOD_NIBLACK:    kParam = defaultNiblackKParam;    break;
+				case SAUVOLA_METHOD_NICK:       kParam = defaultNickKParam;       break;
+				case SAUVOLA_METHOD_PHANSALKAR: kParam = defaultPhansalkarKParam; break;
+				default: break;
+			}
+		}
+		if (kParam < 0 && method != SAUVOLA_METHOD_NIBLACK && method != SAUVOLA_METHOD_NICK)
+			throw argparse_error("-k", "k parameter is too small.");
+		if (integralBits == 32 && integralWindowSize > integralWindowSizeLimit32)
+			throw argparse_error("--integral-bits", "window size is too large for 32-bit integral images.");
 		if (argc - optind != 2)
 			usage(argc, argv, 1);
 		filename_in  = argv[optind++];
@@ -314,85 +411,22 @@ static void maskInset(Mat& img, double width)
 			img.at<unsigned char>(y, x) = tmp.at<float>(y, x) <= width ? 0 : 255;
 }
 
-static bool binarizeUsingSauvola(Mat& dst, const Mat& src, int integralWindowSize, double kParam, double rScale)
+template <typename T>
+static bool binarizeLocally(Mat& dst, const Mat& src, sauvola_method method, int integralWindowSize, double kParam, double rScale, localstat_engine engine, int threads, sauvola_precision precision)
 {
 	int w = src.cols;
-	int h = src.rows;
 	double rParam = rScale * (255.0 * 0.5);
-	int win_n = integralWindowSize / 2;
-	int win_p = integralWindowSize / 2;
-	if ((integralWindowSize % 2) != 0)
-		++win_n;
-	if (
-		src.empty() ||
-		numeric_limits<int>::max() - integralWindowSize < w ||
-		numeric_limits<int>::max() - integralWindowSize < h ||
-		numeric_limits<int>::max() / (w + integralWindowSize) < h + integralWindowSize
-	)
-	{
-		return false;
-	}
-	int pw = w + integralWindowSize;
-	int ph = h + integralWindowSize;
 	double invsqWindow = 1.0 / integralWindowSize / integralWindowSize;
-	dst = Mat(h, w, CV_8U);
-	Mat padimg;
-	copyMakeBorder(src, padimg, win_n, win_p, win_n, win_p, BORDER_REPLICATE);
-	// Make two integral images
-	intimage_type* buffer1 = new intimage_type[pw * ph];
-	intimage_type* buffer2 = new intimage_type[pw * ph];
-	{
-		intimage_type accum1 = 0;
-		intimage_type accum2 = 0;
-		for (int x = 0; x < pw; x++)
-		{
-			intimage_type value = padimg.at<unsigned char>(0, x);
-			accum1 += value;
-			accum2 += value * value;
-			buffer1[x] = accum1;
-			buffer2[x] = accum2;
-		}
-	}
-	for (int y = 1; y < ph; y++)
-	{
-		intimage_type accum1 = 0;
-		intimage_type accum2 = 0;
-		for (int x = 0; x < pw; x++)
-		{
-			intimage_type value = padimg.at<unsigned char>(y, x);
-			accum1 += value;
-			accum2 += value * value;
-			buffer1[pw * y + x] = accum1 + buffer1[pw * (y - 1) + x];
-			buffer2[pw * y + x] = accum2 + buffer2[pw * (y - 1) + x];
-		}
-	}
-	// Fast Sauvola's algorithm
-	for (int y = 0; y < h; y++)
-	{
-		int Y0 = pw * y;
-		int Y1 = pw * (y + integralWindowSize);
-		for (int x = 0; x < w; x++)
+	sauvola_kernel kernel = sauvola_prepare({ invsqWindow, 1.0, kParam, rParam, 0.0, method, precision });
+	dst = Mat(src.rows, w, CV_8U);
+	// Fast local thresholding
+	return localstat_run<T>(engine, src, integralWindowSize,
+		[&](int y, const T* sum1, const T* sum2)
 		{
-			intimage_type total1 =
-				buffer1[Y1 + (x + integralWindowSize)] -
-				buffer1[Y1 + x] +
-				buffer1[Y0 + x] -
-				buffer1[Y0 + (x + integralWindowSize)];
-			intimage_type total2 =
-				buffer2[Y1 + (x + integralWindowSize)] -
-				buffer2[Y1 + x] +
-				buffer2[Y0 + x] -
-				buffer2[Y0 + (x + integralWindowSize)];
-			double mean   = total1 * invsqWindow;
-			double stddev = sqrt(total2 * invsqWindow - mean * mean);
-			int threshold = mean * (1 + kParam * (stddev / rParam - 1));
-			dst.at<unsigned char>(y, x) = padimg.at<unsigned char>(y + win_n, x + win_n) > threshold ? 255 : 0;
-		}
-	}
-	// Finalization
-	delete[] buffer1;
-	delete[] buffer2;
-	return true;
+			// Luminance of colour rows is computed again for thresholding
+			vector<unsigned char> gray(src.channels() == 1 ? 0 : w);
+			sauvola_row(dst.ptr<unsigned char>(y), localstat_row(src, y, gray.data()), sum1, sum2, w, kernel, true);
+		}, threads);
 }
 
 static bool fastInpaint(const Mat& src, const Mat& mask, Mat& dst, InpaintInitMode initMode, int iterations)
@@ -571,12 +605,14 @@ int main(int argc, char** argv)
 	// Background inpainting and isolation
 	Mat bg;
 	{
-		Mat tmp, tmp2;
-		if (img.channels() == 3)
-			cvtColor(img, tmp2, CV_BGR2GRAY);
-		else
-			tmp2 = img;
-		if (!binarizeUsingSauvola(tmp, tmp2, integralWindowSize, kParam, rScale))
+		// Colour images are binarized by luminance without a grayscale copy
+		Mat tmp;
+		// Use the narrowest integral images which give exact window sums
+		bool narrow = integralBits == 32 || (integralBits == 0 && integralWindowSize <= integralWindowSizeLimit32);
+		bool ok = narrow
+			? binarizeLocally<uint_least32_t>(tmp, img, method, integralWindowSize, kParam, rScale, engine, threads, precision)
+			: binarizeLocally<uint_least64_t>(tmp, img, method, integralWindowSize, kParam, rScale, engine, threads, precision);
+		if (!ok)
 		{
 			fprintf(stderr, "%s: image binarization failed.\n", filename_in);
 			return 1;
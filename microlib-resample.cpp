@@ -0,0 +1,141 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Row-by-row Image Resampling
+
+	resample.cpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <cfloat>
+#include <cmath>
+
+#include <algorithm>
+
+#include "microlib/resample.hpp"
+
+
+
+static const int resample_coef_bits  = 11;
+static const int resample_coef_scale = 1 << resample_coef_bits;
+
+static void resample_lanczos4_coeffs(float x, float* coeffs)
+{
+	static const double s45 = 0.70710678118654752440084436210485;
+	static const double cs[][2] = {
+		{ 1, 0 }, { -s45, -s45 }, { 0, 1 }, { s45, -s45 },
+		{ -1, 0 }, { s45, s45 }, { 0, -1 }, { -s45, s45 },
+	};
+	if (x < FLT_EPSILON)
+	{
+		for (int i = 0; i < 8; i++)
+			coeffs[i] = 0;
+		coeffs[3] = 1;
+		return;
+	}
+	float sum = 0;
+	double y0 = -(x + 3) * M_PI * 0.25, s0 = std::sin(y0), c0 = std::cos(y0);
+	for (int i = 0; i < 8; i++)
+	{
+		double y = -(x + 3 - i) * M_PI * 0.25;
+		coeffs[i] = (float)((cs[i][0] * s0 + cs[i][1] * c0) / (y * y));
+		sum += coeffs[i];
+	}
+	sum = 1.f / sum;
+	for (int i = 0; i < 8; i++)
+		coeffs[i] *= sum;
+}
+
+// First source index and fixed-point coefficients for each output index
+static void resample_lanczos4_axis(int sn, int dn, std::vector<int>& ofs, std::vector<short>& coef)
+{
+	double scale = 1. / ((double)dn / sn);
+	ofs.resize(dn);
+	coef.resize(size_t(dn) * 8);
+	for (int d = 0; d < dn; d++)
+	{
+		float f = (float)((d + 0.5) * scale - 0.5);
+		int s = (int)std::floor(f);
+		f -= s;
+		float c[8];
+		resample_lanczos4_coeffs(f, c);
+		ofs[d] = s - 3;
+		for (int k = 0; k < 8; k++)
+			coef[size_t(d) * 8 + k] = (short)std::max(-32768l, std::min(32767l, std::lrint(c[k] * resample_coef_scale)));
+	}
+}
+
+
+
+resample_lanczos4::resample_lanczos4(const cv::Mat& src, int dw, int dh)
+	: src(&src), dw(dw), dh(dh)
+{
+	resample_lanczos4_axis(src.cols, dw, xofs, alpha);
+	resample_lanczos4_axis(src.rows, dh, yofs, beta);
+}
+
+void resample_lanczos4::rows(int y0, int y1, unsigned char* dst, size_t step) const
+{
+	if (y0 >= y1)
+		return;
+	int sw = src->cols;
+	int sh = src->rows;
+	// Horizontally resampled source rows [r0, r1]
+	int r0 = std::max(yofs[y0], 0);
+	int r1 = std::min(yofs[y1 - 1] + 7, sh - 1);
+	std::vector<int> hbuf(size_t(r1 - r0 + 1) * dw);
+	for (int r = r0; r <= r1; r++)
+	{
+		const unsigned char* s = src->ptr<unsigned char>(r);
+		int* d = hbuf.data() + size_t(r - r0) * dw;
+		for (int x = 0; x < dw; x++)
+		{
+			const short* a = alpha.data() + size_t(x) * 8;
+			int sx = xofs[x];
+			int v = 0;
+			if (sx >= 0 && sx + 7 < sw)
+			{
+				for (int k = 0; k < 8; k++)
+					v += s[sx + k] * a[k];
+			}
+			else
+			{
+				for (int k = 0; k < 8; k++)
+					v += s[std::min(std::max(sx + k, 0), sw - 1)] * a[k];
+			}
+			d[x] = v;
+		}
+	}
+	// Vertical pass
+	for (int y = y0; y < y1; y++)
+	{
+		const short* b = beta.data() + size_t(y) * 8;
+		const int* h[8];
+		for (int k = 0; k < 8; k++)
+			h[k] = hbuf.data() + size_t(std::min(std::max(yofs[y] + k, 0), sh - 1) - r0) * dw;
+		unsigned char* d = dst + step * (y - y0);
+		for (int x = 0; x < dw; x++)
+		{
+			int v = h[0][x] * b[0] + h[1][x] * b[1] + h[2][x] * b[2] + h[3][x] * b[3]
+				+ h[4][x] * b[4] + h[5][x] * b[5] + h[6][x] * b[6] + h[7][x] * b[7];
+			v = (v + (1 << (resample_coef_bits * 2 - 1))) >> (resample_coef_bits * 2);
+			d[x] = (unsigned char)std::min(std::max(v, 0), 255);
+		}
+	}
+}
@@ -0,0 +1,822 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Sauvola's Threshold Kernels
+
+	sauvola.cpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+/*
+	SIMD variants evaluate exactly the same sequence of IEEE 754 double
+	operations as the scalar one (no FMA contraction), so that the output
+	does not depend on the CPU.
+	Each thresholding method is a functor shared by all variants.
+*/
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SAUVOLA_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#include "microlib/sauvola.hpp"
+
+#ifdef __GNUC__
+#define SAUVOLA_INLINE inline __attribute__((always_inline))
+#else
+#define SAUVOLA_INLINE inline
+#endif
+
+
+
+static inline void sauvola_exp(double& v)
+{
+	v = std::exp(v);
+}
+
+#ifdef SAUVOLA_X86_SIMD
+// Lane by lane (same results as the scalar one)
+template <typename V>
+static SAUVOLA_INLINE void sauvola_exp(V& v)
+{
+	for (size_t i = 0; i < sizeof(V) / sizeof(v[0]); i++)
+		v[i] = std::exp(v[i]);
+}
+#endif
+
+/*
+	Threshold functors:
+	radicand(r, mean, var) gives r, whose square root is passed as root to
+	threshold(t, mean, root, p) giving the threshold t.
+	V is double, __m128d or __m256d with sauvola_params, or __m256 with
+	sauvola_fparams (passed by reference so that vector arguments do not
+	depend on the ABI of the caller).
+*/
+struct sauvola_fn_sauvola
+{
+	template <typename V>
+	static SAUVOLA_INLINE void radicand(V& r, const V&, const V& var)
+	{
+		r = var;
+	}
+	template <typename V, typename P>
+	static SAUVOLA_INLINE void threshold(V& t, const V& mean, const V& root, const P& p)
+	{
+		t = p.tScale * mean * (1 + p.kParam * (root / p.rParam - 1)) + p.tRealBias;
+	}
+};
+
+struct sauvola_fn_niblack
+{
+	template <typename V>
+	static SAUVOLA_INLINE void radicand(V& r, const V&, const V& var)
+	{
+		r = var;
+	}
+	template <typename V, typename P>
+	static SAUVOLA_INLINE void threshold(V& t, const V& mean, const V& root, const P& p)
+	{
+		t = p.tScale * (mean + p.kParam * root) + p.tRealBias;
+	}
+};
+
+struct sauvola_fn_nick
+{
+	template <typename V>
+	static SAUVOLA_INLINE void radicand(V& r, const V& mean, const V& var)
+	{
+		r = var + mean * mean;
+	}
+	template <typename V, typename P>
+	static SAUVOLA_INLINE void threshold(V& t, const V& mean, const V& root, const P& p)
+	{
+		t = p.tScale * (mean + p.kParam * root) + p.tRealBias;
+	}
+};
+
+struct sauvola_fn_phansalkar
+{
+	template <typename V>
+	static SAUVOLA_INLINE void radicand(V& r, const V&, const V& var)
+	{
+		r = var;
+	}
+	template <typename V, typename P>
+	static SAUVOLA_INLINE void threshold(V& t, const V& mean, const V& root, const P& p)
+	{
+		V e = mean * decltype(p.kParam)(-10.0 / 255.0);
+		sauvola_exp(e);
+		t = p.tScale * mean * (1 + 2 * e + p.kParam * (root / p.rParam - 1)) + p.tRealBias;
+	}
+};
+
+
+
+template <typename F>
+static inline double sauvola_threshold_method(double mean, double var, const sauvola_params& params)
+{
+	double r, t;
+	F::radicand(r, mean, var);
+	F::threshold(t, mean, std::sqrt(r), params);
+	return t;
+}
+
+template <typename F, typename T>
+static inline int sauvola_pixel_threshold(T s1, T s2, const sauvola_params& p)
+{
+	double mean = s1 * p.invsqWindow;
+	return sauvola_threshold_method<F>(mean, s2 * p.invsqWindow - mean * mean, p);
+}
+
+template <typename F, bool binary, typename T>
+static inline void sauvola_row_scalar(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int x0, int x1, const sauvola_params& p)
+{
+	for (int x = x0; x < x1; x++)
+	{
+		int threshold = sauvola_pixel_threshold<F>(sum1[x], sum2[x], p);
+		if (binary)
+			dst[x] = src[x] > threshold ? 255 : 0;
+		else
+			dst[x] = threshold;
+	}
+}
+
+
+
+/*
+	Binary decision without sqrt and division:
+
+	With q = src[x] (or -1 if src[x] == 0, which gives the same result
+	for the truncated threshold), src[x] > threshold is equivalent to
+		L > dm * stddev
+		L  = q - tRealBias - tScale * (1 - kParam) * mean
+		dm = tScale * kParam / rParam * mean (>= 0)
+	which is decided by the sign of L and L^2 - dm^2 * variance.
+	Pixels too close to the threshold to be decided this way
+	(within a margin far larger than rounding errors) are left to the
+	reference formula, so that the output is always identical.
+*/
+static sauvola_decision sauvola_decision_prepare(const sauvola_params& p)
+{
+	sauvola_decision d;
+	d.c1 = p.tScale * (1 - p.kParam);
+	d.ck = p.tScale * p.kParam / p.rParam;
+	// Upper bound of magnitudes appearing in the threshold (mean <= 255, stddev <= 127.5)
+	double m = std::fabs(p.tScale) * 256.0 * (1 + std::fabs(p.kParam) * (128.0 / std::fabs(p.rParam) + 1))
+		+ std::fabs(p.tRealBias) + 256.0;
+	d.eps  = std::ldexp(m, -36);
+	d.eps2 = std::ldexp(m * m, -34);
+	// Thresholds must not overflow int
+	d.enabled = std::isfinite(d.c1) && d.ck >= 0 && std::isfinite(d.ck) && m < 1073741824.0;
+	return d;
+}
+
+// 1: white, 0: black, -1: undecided
+template <typename T>
+static inline int sauvola_decide(unsigned char v, T s1, T s2, const sauvola_params& p, const sauvola_decision& d)
+{
+	double mean = s1 * p.invsqWindow;
+	double var  = s2 * p.invsqWindow - mean * mean;
+	if (var < 0)
+	{
+#ifdef SAUVOLA_X86_SIMD
+		// stddev is NaN and the threshold is INT_MIN (cvttsd2si)
+		return 1;
+#else
+		return -1;
+#endif
+	}
+	double L = (double(v ? v : -1) - p.tRealBias) - d.c1 * mean;
+	if (L < -d.eps)
+		return 0;
+	if (L <= d.eps)
+		return -1;
+	double dm = d.ck * mean;
+	double diff = L * L - dm * dm * var;
+	if (diff > d.eps2)
+		return 1;
+	if (diff < -d.eps2)
+		return 0;
+	return -1;
+}
+
+template <typename T>
+static inline void sauvola_binary_scalar(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int x0, int x1, const sauvola_params& p, const sauvola_decision& d)
+{
+	for (int x = x0; x < x1; x++)
+	{
+		int r = sauvola_decide(src[x], sum1[x], sum2[x], p, d);
+		if (r < 0)
+			r = src[x] > sauvola_pixel_threshold<sauvola_fn_sauvola>(sum1[x], sum2[x], p);
+		dst[x] = r ? 255 : 0;
+	}
+}
+
+
+
+#ifdef SAUVOLA_X86_SIMD
+
+static_assert(sizeof(uint_least32_t) == 4, "uint_least32_t must be 32-bit.");
+static_assert(sizeof(uint_least64_t) == 8, "uint_least64_t must be 64-bit.");
+
+// Unsigned integers to doubles (64-bit values must be less than 2^52)
+__attribute__((target("sse4.2")))
+static inline __m128d sse42_load2(const uint_least32_t* p)
+{
+	__m128i v = _mm_xor_si128(_mm_loadl_epi64((const __m128i*)p), _mm_set1_epi32(int(0x80000000u)));
+	return _mm_add_pd(_mm_cvtepi32_pd(v), _mm_set1_pd(2147483648.0));
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128d sse42_load2(const uint_least64_t* p)
+{
+	__m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi64x(0x4330000000000000ll));
+	return _mm_sub_pd(_mm_castsi128_pd(v), _mm_set1_pd(4503599627370496.0));
+}
+
+__attribute__((target("sse4.2")))
+static inline bool sse42_exact(const uint_least32_t*, int)
+{
+	return true;
+}
+
+__attribute__((target("sse4.2")))
+static inline bool sse42_exact(const uint_least64_t* p, int n)
+{
+	__m128i m = _mm_setzero_si128();
+	for (int i = 0; i < n; i += 2)
+		m = _mm_or_si128(m, _mm_loadu_si128((const __m128i*)(p + i)));
+	return _mm_testz_si128(m, _mm_set1_epi64x((long long)(~0ull << 52)));
+}
+
+// Thresholds of two pixels (as int32 in lower half)
+template <typename F>
+__attribute__((target("sse4.2")))
+static inline __m128i sse42_threshold2(__m128d s1, __m128d s2, const sauvola_params& p)
+{
+	__m128d inv  = _mm_set1_pd(p.invsqWindow);
+	__m128d mean = _mm_mul_pd(s1, inv);
+	__m128d var  = _mm_sub_pd(_mm_mul_pd(s2, inv), _mm_mul_pd(mean, mean));
+	__m128d r, t;
+	F::radicand(r, mean, var);
+	F::threshold(t, mean, _mm_sqrt_pd(r), p);
+	return _mm_cvttpd_epi32(t);
+}
+
+template <typename F, bool binary, typename T>
+__attribute__((target("sse4.2")))
+static void sauvola_row_sse42(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& p)
+{
+	const __m128i lowbytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	int x = 0;
+	for (; x + 8 <= w; x += 8)
+	{
+		if (!sse42_exact(sum2 + x, 8))
+		{
+			sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, x, x + 8, p);
+			continue;
+		}
+		__m128i th[2];
+		for (int i = 0; i < 2; i++)
+		{
+			const T* s1 = sum1 + x + 4 * i;
+			const T* s2 = sum2 + x + 4 * i;
+			__m128i t0 = sse42_threshold2<F>(sse42_load2(s1    ), sse42_load2(s2    ), p);
+			__m128i t1 = sse42_threshold2<F>(sse42_load2(s1 + 2), sse42_load2(s2 + 2), p);
+			th[i] = _mm_unpacklo_epi64(t0, t1);
+		}
+		__m128i r;
+		if (binary)
+		{
+			__m128i v = _mm_loadl_epi64((const __m128i*)(src + x));
+			__m128i m0 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(v), th[0]);
+			__m128i m1 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), th[1]);
+			r = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_setzero_si128());
+		}
+		else
+		{
+			r = _mm_unpacklo_epi32(_mm_shuffle_epi8(th[0], lowbytes), _mm_shuffle_epi8(th[1], lowbytes));
+		}
+		_mm_storel_epi64((__m128i*)(dst + x), r);
+	}
+	sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, x, w, p);
+}
+
+// Binary decisions of two pixels (int32 in lower half; all bits set if white)
+__attribute__((target("sse4.2")))
+static inline __m128d sse42_decide2(__m128d s1, __m128d s2, __m128i v,
+	const sauvola_params& p, const sauvola_decision& d, bool& decided)
+{
+	__m128d inv  = _mm_set1_pd(p.invsqWindow);
+	__m128d mean = _mm_mul_pd(s1, inv);
+	__m128d var  = _mm_sub_pd(_mm_mul_pd(s2, inv), _mm_mul_pd(mean, mean));
+	__m128d q    = _mm_cvtepi32_pd(_mm_add_epi32(v, _mm_cmpeq_epi32(v, _mm_setzero_si128())));
+	__m128d L    = _mm_sub_pd(_mm_sub_pd(q, _mm_set1_pd(p.tRealBias)), _mm_mul_pd(_mm_set1_pd(d.c1), mean));
+	__m128d dm   = _mm_mul_pd(_mm_set1_pd(d.ck), mean);
+	__m128d diff = _mm_sub_pd(_mm_mul_pd(L, L), _mm_mul_pd(_mm_mul_pd(dm, dm), var));
+	__m128d nan  = _mm_cmplt_pd(var, _mm_setzero_pd());
+	__m128d far  = _mm_cmpgt_pd(L, _mm_set1_pd(d.eps));
+	__m128d white = _mm_or_pd(nan, _mm_and_pd(far, _mm_cmpgt_pd(diff, _mm_set1_pd(d.eps2))));
+	__m128d black = _mm_andnot_pd(nan, _mm_or_pd(_mm_cmplt_pd(L, _mm_set1_pd(-d.eps)),
+		_mm_and_pd(far, _mm_cmplt_pd(diff, _mm_set1_pd(-d.eps2)))));
+	decided = decided && _mm_movemask_pd(_mm_or_pd(white, black)) == 3;
+	return white;
+}
+
+// Binary decisions of four pixels (as int32)
+template <typename T>
+__attribute__((target("sse4.2")))
+static inline __m128i sse42_decide4(const T* s1, const T* s2, __m128i v,
+	const sauvola_params& p, const sauvola_decision& d, bool& decided)
+{
+	__m128d w0 = sse42_decide2(sse42_load2(s1    ), sse42_load2(s2    ), v, p, d, decided);
+	__m128d w1 = sse42_decide2(sse42_load2(s1 + 2), sse42_load2(s2 + 2), _mm_srli_si128(v, 8), p, d, decided);
+	return _mm_unpacklo_epi64(
+		_mm_shuffle_epi32(_mm_castpd_si128(w0), _MM_SHUFFLE(2, 0, 2, 0)),
+		_mm_shuffle_epi32(_mm_castpd_si128(w1), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+template <typename T>
+__attribute__((target("sse4.2")))
+static void sauvola_binary_sse42(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& p, const sauvola_decision& d)
+{
+	int x = 0;
+	for (; x + 8 <= w; x += 8)
+	{
+		if (sse42_exact(sum2 + x, 8))
+		{
+			bool decided = true;
+			__m128i v = _mm_loadl_epi64((const __m128i*)(src + x));
+			__m128i m0 = sse42_decide4(sum1 + x,     sum2 + x,     _mm_cvtepu8_epi32(v), p, d, decided);
+			__m128i m1 = sse42_decide4(sum1 + x + 4, sum2 + x + 4, _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), p, d, decided);
+			if (decided)
+			{
+				_mm_storel_epi64((__m128i*)(dst + x), _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_setzero_si128()));
+				continue;
+			}
+		}
+		sauvola_binary_scalar(dst, src, sum1, sum2, x, x + 8, p, d);
+	}
+	sauvola_binary_scalar(dst, src, sum1, sum2, x, w, p, d);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d avx2_load4(const uint_least32_t* p)
+{
+	__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi32(int(0x80000000u)));
+	return _mm256_add_pd(_mm256_cvtepi32_pd(v), _mm256_set1_pd(2147483648.0));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d avx2_load4(const uint_least64_t* p)
+{
+	__m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_set1_epi64x(0x4330000000000000ll));
+	return _mm256_sub_pd(_mm256_castsi256_pd(v), _mm256_set1_pd(4503599627370496.0));
+}
+
+__attribute__((target("avx2")))
+static inline bool avx2_exact(const uint_least32_t*, int)
+{
+	return true;
+}
+
+__attribute__((target("avx2")))
+static inline bool avx2_exact(const uint_least64_t* p, int n)
+{
+	__m256i m = _mm256_setzero_si256();
+	for (int i = 0; i < n; i += 4)
+		m = _mm256_or_si256(m, _mm256_loadu_si256((const __m256i*)(p + i)));
+	return _mm256_testz_si256(m, _mm256_set1_epi64x((long long)(~0ull << 52)));
+}
+
+// Thresholds of four pixels (as int32)
+template <typename F>
+__attribute__((target("avx2")))
+static inline __m128i avx2_threshold4(__m256d s1, __m256d s2, const sauvola_params& p)
+{
+	__m256d inv  = _mm256_set1_pd(p.invsqWindow);
+	__m256d mean = _mm256_mul_pd(s1, inv);
+	__m256d var  = _mm256_sub_pd(_mm256_mul_pd(s2, inv), _mm256_mul_pd(mean, mean));
+	__m256d r, t;
+	F::radicand(r, mean, var);
+	F::threshold(t, mean, _mm256_sqrt_pd(r), p);
+	return _mm256_cvttpd_epi32(t);
+}
+
+template <typename F, bool binary, typename T>
+__attribute__((target("avx2")))
+static void sauvola_row_avx2(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& p)
+{
+	const __m128i lowbytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	int x = 0;
+	for (; x + 16 <= w; x += 16)
+	{
+		if (!avx2_exact(sum2 + x, 16))
+		{
+			sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, x, x + 16, p);
+			continue;
+		}
+		__m128i th[4];
+		for (int i = 0; i < 4; i++)
+			th[i] = avx2_threshold4<F>(avx2_load4(sum1 + x + 4 * i), avx2_load4(sum2 + x + 4 * i), p);
+		__m128i r;
+		if (binary)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+			__m128i m0 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(v), th[0]);
+			__m128i m1 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), th[1]);
+			__m128i m2 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8)), th[2]);
+			__m128i m3 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12)), th[3]);
+			r = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3));
+		}
+		else
+		{
+			r = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi32(_mm_shuffle_epi8(th[0], lowbytes), _mm_shuffle_epi8(th[1], lowbytes)),
+				_mm_unpacklo_epi32(_mm_shuffle_epi8(th[2], lowbytes), _mm_shuffle_epi8(th[3], lowbytes)));
+		}
+		_mm_storeu_si128((__m128i*)(dst + x), r);
+	}
+	sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, x, w, p);
+}
+
+// Binary decisions of four pixels (as int32)
+__attribute__((target("avx2")))
+static inline __m128i avx2_decide4(__m256d s1, __m256d s2, __m128i v,
+	const sauvola_params& p, const sauvola_decision& d, bool& decided)
+{
+	__m256d inv  = _mm256_set1_pd(p.invsqWindow);
+	__m256d mean = _mm256_mul_pd(s1, inv);
+	__m256d var  = _mm256_sub_pd(_mm256_mul_pd(s2, inv), _mm256_mul_pd(mean, mean));
+	__m256d q    = _mm256_cvtepi32_pd(_mm_add_epi32(v, _mm_cmpeq_epi32(v, _mm_setzero_si128())));
+	__m256d L    = _mm256_sub_pd(_mm256_sub_pd(q, _mm256_set1_pd(p.tRealBias)), _mm256_mul_pd(_mm256_set1_pd(d.c1), mean));
+	__m256d dm   = _mm256_mul_pd(_mm256_set1_pd(d.ck), mean);
+	__m256d diff = _mm256_sub_pd(_mm256_mul_pd(L, L), _mm256_mul_pd(_mm256_mul_pd(dm, dm), var));
+	__m256d nan  = _mm256_cmp_pd(var, _mm256_setzero_pd(), _CMP_LT_OQ);
+	__m256d far  = _mm256_cmp_pd(L, _mm256_set1_pd(d.eps), _CMP_GT_OQ);
+	__m256d white = _mm256_or_pd(nan, _mm256_and_pd(far, _mm256_cmp_pd(diff, _mm256_set1_pd(d.eps2), _CMP_GT_OQ)));
+	__m256d black = _mm256_andnot_pd(nan, _mm256_or_pd(_mm256_cmp_pd(L, _mm256_set1_pd(-d.eps), _CMP_LT_OQ),
+		_mm256_and_pd(far, _mm256_cmp_pd(diff, _mm256_set1_pd(-d.eps2), _CMP_LT_OQ))));
+	decided = decided && _mm256_movemask_pd(_mm256_or_pd(white, black)) == 15;
+	return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(white),
+		_mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)));
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void sauvola_binary_avx2(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& p, const sauvola_decision& d)
+{
+	int x = 0;
+	for (; x + 16 <= w; x += 16)
+	{
+		if (avx2_exact(sum2 + x, 16))
+		{
+			bool decided = true;
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+			__m128i m0 = avx2_decide4(avx2_load4(sum1 + x     ), avx2_load4(sum2 + x     ), _mm_cvtepu8_epi32(v), p, d, decided);
+			__m128i m1 = avx2_decide4(avx2_load4(sum1 + x +  4), avx2_load4(sum2 + x +  4), _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), p, d, decided);
+			__m128i m2 = avx2_decide4(avx2_load4(sum1 + x +  8), avx2_load4(sum2 + x +  8), _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)), p, d, decided);
+			__m128i m3 = avx2_decide4(avx2_load4(sum1 + x + 12), avx2_load4(sum2 + x + 12), _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)), p, d, decided);
+			if (decided)
+			{
+				_mm_storeu_si128((__m128i*)(dst + x), _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3)));
+				continue;
+			}
+		}
+		sauvola_binary_scalar(dst, src, sum1, sum2, x, x + 16, p, d);
+	}
+	sauvola_binary_scalar(dst, src, sum1, sum2, x, w, p, d);
+}
+
+/*
+	Single precision (AVX2, 32-bit sums):
+
+	With n pixels in the window, n^2 * variance = n * sum2 - sum1^2 is
+	computed exactly in 64-bit integers (less than 2^48 for n <= 257^2)
+	and rounded once to float, and the rest of the formula is evaluated on
+	eight pixels at once. Its rounding errors stay well below
+	eps = 2^-20 * m (m: upper bound of magnitudes appearing in the threshold
+	of any method), so a lane is taken if truncating the threshold -/+ eps
+	gives the same integer. Other pixels are left to the double precision
+	formula, and so are flat windows (zero variance, where double precision
+	may give NaN), computed in advance for each intensity.
+*/
+template <typename F>
+static void sauvola_float_prepare(sauvola_float& s, const sauvola_params& p)
+{
+	double n = std::floor(1 / p.invsqWindow + 0.5);
+	double m = std::fabs(p.tScale) * (256.0 * (1 + std::fabs(p.kParam) * (128.0 / std::fabs(p.rParam) + 2)) + 32.0)
+		+ std::fabs(p.tRealBias) + 256.0;
+	// Sums must be those of n pixels, and thresholds must not overflow int
+	s.enabled = n >= 1 && n <= 257.0 * 257.0 && std::fabs(n * p.invsqWindow - 1) < 1e-9 && m < 1048576.0;
+	if (!s.enabled)
+		return;
+	s.n     = uint_least32_t(n);
+	s.invn  = float(p.invsqWindow);
+	s.invn2 = float(p.invsqWindow * p.invsqWindow);
+	s.eps   = float(std::ldexp(m, -20));
+	s.fp    = { float(p.tScale), float(p.kParam), float(p.rParam), float(p.tRealBias) };
+	// Sums of flat windows (n * 255^2 < 2^32)
+	for (uint_least32_t v = 0; v < 256; v++)
+		s.flat[v] = sauvola_pixel_threshold<F>(s.n * v, s.n * v * v, p);
+}
+
+template <typename F>
+static inline int sauvola_float_fallback(uint_least32_t s1, uint_least32_t s2, const sauvola_params& p, const sauvola_float& s)
+{
+	if (uint_least64_t(s.n) * s2 != uint_least64_t(s1) * s1)
+		return sauvola_pixel_threshold<F>(s1, s2, p);
+	return s.flat[s1 / s.n];
+}
+
+template <typename F, bool binary>
+__attribute__((target("avx2")))
+static void sauvola_row_float_avx2(unsigned char* dst, const unsigned char* src,
+	const uint_least32_t* sum1, const uint_least32_t* sum2, int w, const sauvola_params& p, const sauvola_float& s)
+{
+	const __m128i lowbytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i n      = _mm256_set1_epi64x(s.n);
+	const __m256i magic  = _mm256_set1_epi64x(0x4330000000000000ll);
+	const __m256d magicd = _mm256_set1_pd(4503599627370496.0);
+	const __m256  invn   = _mm256_set1_ps(s.invn);
+	const __m256  invn2  = _mm256_set1_ps(s.invn2);
+	const __m256  eps    = _mm256_set1_ps(s.eps);
+	int x = 0;
+	for (; x + 8 <= w; x += 8)
+	{
+		__m256i s1 = _mm256_loadu_si256((const __m256i*)(sum1 + x));
+		__m256i s2 = _mm256_loadu_si256((const __m256i*)(sum2 + x));
+		// n * sum2 - sum1^2 of even and odd pixels (via double, exact below 2^52)
+		__m256i s1o = _mm256_srli_epi64(s1, 32);
+		__m256i v0  = _mm256_sub_epi64(_mm256_mul_epu32(s2, n), _mm256_mul_epu32(s1, s1));
+		__m256i v1  = _mm256_sub_epi64(_mm256_mul_epu32(_mm256_srli_epi64(s2, 32), n), _mm256_mul_epu32(s1o, s1o));
+		__m128  f0  = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v0, magic)), magicd));
+		__m128  f1  = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v1, magic)), magicd));
+		__m256  vn  = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_unpacklo_ps(f0, f1)), _mm_unpackhi_ps(f0, f1), 1);
+		__m256 mean = _mm256_mul_ps(_mm256_cvtepi32_ps(s1), invn);
+		__m256 var  = _mm256_mul_ps(vn, invn2);
+		__m256 r, t;
+		F::radicand(r, mean, var);
+		F::threshold(t, mean, _mm256_sqrt_ps(r), s.fp);
+		__m256i th = _mm256_cvttps_epi32(t);
+		__m256i certain = _mm256_cmpeq_epi32(_mm256_cvttps_epi32(_mm256_sub_ps(t, eps)), _mm256_cvttps_epi32(_mm256_add_ps(t, eps)));
+		int ok = _mm256_movemask_ps(_mm256_andnot_ps(_mm256_cmp_ps(vn, _mm256_setzero_ps(), _CMP_EQ_OQ), _mm256_castsi256_ps(certain)));
+		if (ok != 0xff)
+		{
+			int tv[8];
+			_mm256_storeu_si256((__m256i*)tv, th);
+			for (int i = 0; i < 8; i++)
+			{
+				if (!(ok >> i & 1))
+					tv[i] = sauvola_float_fallback<F>(sum1[x + i], sum2[x + i], p, s);
+				if (binary)
+					dst[x + i] = src[x + i] > tv[i] ? 255 : 0;
+				else
+					dst[x + i] = tv[i];
+			}
+			continue;
+		}
+		__m128i t0 = _mm256_castsi256_si128(th);
+		__m128i t1 = _mm256_extracti128_si256(th, 1);
+		__m128i rv;
+		if (binary)
+		{
+			__m128i v = _mm_loadl_epi64((const __m128i*)(src + x));
+			__m128i m0 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(v), t0);
+			__m128i m1 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), t1);
+			rv = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_setzero_si128());
+		}
+		else
+		{
+			rv = _mm_unpacklo_epi32(_mm_shuffle_epi8(t0, lowbytes), _mm_shuffle_epi8(t1, lowbytes));
+		}
+		_mm_storel_epi64((__m128i*)(dst + x), rv);
+	}
+	sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, x, w, p);
+}
+
+#endif
+
+
+
+static sauvola_simd sauvola_simd_supported()
+{
+#ifdef SAUVOLA_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SAUVOLA_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return SAUVOLA_SIMD_SSE42;
+#endif
+	return SAUVOLA_SIMD_NONE;
+}
+
+static sauvola_simd sauvola_simd_current = sauvola_simd_supported();
+
+sauvola_simd sauvola_set_simd(sauvola_simd simd)
+{
+	sauvola_simd supported = sauvola_simd_supported();
+	sauvola_simd_current = simd < supported ? simd : supported;
+	return sauvola_simd_current;
+}
+
+const char* sauvola_simd_name(sauvola_simd simd)
+{
+	switch (simd)
+	{
+		case SAUVOLA_SIMD_NONE:  return "none";
+		case SAUVOLA_SIMD_SSE42: return "sse4.2";
+		case SAUVOLA_SIMD_AVX2:  return "avx2";
+		default:                 return "auto";
+	}
+}
+
+template <typename F, bool binary, typename T>
+static inline void sauvola_row_dispatch(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& params)
+{
+	switch (sauvola_simd_current)
+	{
+#ifdef SAUVOLA_X86_SIMD
+		case SAUVOLA_SIMD_AVX2:
+			sauvola_row_avx2<F, binary>(dst, src, sum1, sum2, w, params);
+			break;
+		case SAUVOLA_SIMD_SSE42:
+			sauvola_row_sse42<F, binary>(dst, src, sum1, sum2, w, params);
+			break;
+#endif
+		default:
+			sauvola_row_scalar<F, binary>(dst, src, sum1, sum2, 0, w, params);
+			break;
+	}
+}
+
+template <typename T>
+static inline void sauvola_binary_dispatch(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_params& params, const sauvola_decision& d)
+{
+	switch (sauvola_simd_current)
+	{
+#ifdef SAUVOLA_X86_SIMD
+		case SAUVOLA_SIMD_AVX2:
+			sauvola_binary_avx2(dst, src, sum1, sum2, w, params, d);
+			break;
+		case SAUVOLA_SIMD_SSE42:
+			sauvola_binary_sse42(dst, src, sum1, sum2, w, params, d);
+			break;
+#endif
+		default:
+			sauvola_binary_scalar(dst, src, sum1, sum2, 0, w, params, d);
+			break;
+	}
+}
+
+// Single precision kernel if requested and available (false if not processed)
+template <typename F>
+static inline bool sauvola_row_float(unsigned char*, const unsigned char*,
+	const uint_least64_t*, const uint_least64_t*, int, const sauvola_kernel&, bool)
+{
+	return false;
+}
+
+template <typename F>
+static inline bool sauvola_row_float(unsigned char* dst, const unsigned char* src,
+	const uint_least32_t* sum1, const uint_least32_t* sum2, int w, const sauvola_kernel& k, bool binary)
+{
+#ifdef SAUVOLA_X86_SIMD
+	if (!k.single.enabled || sauvola_simd_current != SAUVOLA_SIMD_AVX2)
+		return false;
+	if (binary)
+		sauvola_row_float_avx2<F, true>(dst, src, sum1, sum2, w, k.params, k.single);
+	else
+		sauvola_row_float_avx2<F, false>(dst, src, sum1, sum2, w, k.params, k.single);
+	return true;
+#else
+	return false;
+#endif
+}
+
+template <typename F, typename T>
+static inline void sauvola_row_method(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_kernel& k, bool binary)
+{
+	if (sauvola_row_float<F>(dst, src, sum1, sum2, w, k, binary))
+		return;
+	if (binary)
+		sauvola_row_dispatch<F, true>(dst, src, sum1, sum2, w, k.params);
+	else
+		sauvola_row_dispatch<F, false>(dst, src, sum1, sum2, w, k.params);
+}
+
+template <typename T>
+static inline void sauvola_row_select(unsigned char* dst, const unsigned char* src,
+	const T* sum1, const T* sum2, int w, const sauvola_kernel& k, bool binary)
+{
+	switch (k.params.method)
+	{
+		case SAUVOLA_METHOD_NIBLACK:
+			sauvola_row_method<sauvola_fn_niblack>(dst, src, sum1, sum2, w, k, binary);
+			return;
+		case SAUVOLA_METHOD_NICK:
+			sauvola_row_method<sauvola_fn_nick>(dst, src, sum1, sum2, w, k, binary);
+			return;
+		case SAUVOLA_METHOD_PHANSALKAR:
+			sauvola_row_method<sauvola_fn_phansalkar>(dst, src, sum1, sum2, w, k, binary);
+			return;
+		default:
+			break;
+	}
+	if (sauvola_row_float<sauvola_fn_sauvola>(dst, src, sum1, sum2, w, k, binary))
+		return;
+	if (binary && k.decision.enabled)
+	{
+		sauvola_binary_dispatch(dst, src, sum1, sum2, w, k.params, k.decision);
+		return;
+	}
+	sauvola_row_method<sauvola_fn_sauvola>(dst, src, sum1, sum2, w, k, binary);
+}
+
+sauvola_kernel sauvola_prepare(const sauvola_params& params)
+{
+	sauvola_kernel k;
+	k.params   = params;
+	k.decision = sauvola_decision_prepare(params);
+	k.single.enabled = false;
+#ifdef SAUVOLA_X86_SIMD
+	if (params.precision == SAUVOLA_PRECISION_FLOAT)
+	{
+		switch (params.method)
+		{
+			case SAUVOLA_METHOD_NIBLACK:
+				sauvola_float_prepare<sauvola_fn_niblack>(k.single, params);
+				break;
+			case SAUVOLA_METHOD_NICK:
+				sauvola_float_prepare<sauvola_fn_nick>(k.single, params);
+				break;
+			case SAUVOLA_METHOD_PHANSALKAR:
+				sauvola_float_prepare<sauvola_fn_phansalkar>(k.single, params);
+				break;
+			default:
+				sauvola_float_prepare<sauvola_fn_sauvola>(k.single, params);
+				break;
+		}
+	}
+#endif
+	return k;
+}
+
+double sauvola_threshold(double mean, double var, const sauvola_params& params)
+{
+	switch (params.method)
+	{
+		case SAUVOLA_METHOD_NIBLACK:
+			return sauvola_threshold_method<sauvola_fn_niblack>(mean, var, params);
+		case SAUVOLA_METHOD_NICK:
+			return sauvola_threshold_method<sauvola_fn_nick>(mean, var, params);
+		case SAUVOLA_METHOD_PHANSALKAR:
+			return sauvola_threshold_method<sauvola_fn_phansalkar>(mean, var, params);
+		default:
+			return sauvola_threshold_method<sauvola_fn_sauvola>(mean, var, params);
+	}
+}
+
+void sauvola_row(unsigned char* dst, const unsigned char* src,
+	const uint_least32_t* sum1, const uint_least32_t* sum2,
+	int w, const sauvola_kernel& kernel, bool binary)
+{
+	sauvola_row_select(dst, src, sum1, sum2, w, kernel, binary);
+}
+
+void sauvola_row(unsigned char* dst, const unsigned char* src,
+	const uint_least64_t* sum1, const uint_least64_t* sum2,
+	int w, const sauvola_kernel& kernel, bool binary)
+{
+	sauvola_row_select(dst, src, sum1, sum2, w, kernel, binary);
+}
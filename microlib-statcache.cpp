@@ -0,0 +1,197 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Local Statistics Cache
+
+	statcache.cpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "microlib/statcache.hpp"
+
+
+
+static const char statcache_magic[8] = { 'S', 'V', 'S', 'T', 'A', 'T', '0', '2' };
+static const uint32_t statcache_byte_order = 0x01020304u;
+static const size_t statcache_align = 64;
+
+struct statcache_header
+{
+	char     magic[8]; // zero until the cache is complete
+	uint32_t byte_order;
+	int32_t  width;
+	int32_t  height;
+	uint32_t reserved;
+	statcache_key key;
+};
+
+static inline size_t statcache_round(size_t n)
+{
+	return (n + statcache_align - 1) / statcache_align * statcache_align;
+}
+
+
+
+bool statcache_hash_file(const char* filename, uint64_t& hash, uint64_t& size)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (!fp)
+		return false;
+	unsigned char buf[65536];
+	uint64_t h = 0xcbf29ce484222325ull;
+	uint64_t n = 0;
+	size_t sz;
+	while ((sz = fread(buf, 1, sizeof(buf), fp)) != 0)
+	{
+		for (size_t i = 0; i < sz; i++)
+			h = (h ^ buf[i]) * 0x100000001b3ull;
+		n += sz;
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	hash = h;
+	size = n;
+	return ok;
+}
+
+
+
+statcache::statcache()
+	: fd(-1), map(nullptr), mapsize(0), w(0), h(0),
+	  offset_image(0), offset_sum1(0), offset_sum2(0)
+{
+}
+
+statcache::~statcache()
+{
+	close();
+}
+
+bool statcache::layout(const statcache_key& key, int w, int h)
+{
+	if (w <= 0 || h <= 0 || key.nwindows == 0 || key.nwindows > STATCACHE_MAX_WINDOWS)
+		return false;
+	if (key.sum_bits != 32 && key.sum_bits != 64)
+		return false;
+	size_t plane = size_t(w) * size_t(h) * key.nwindows * (key.sum_bits / 8);
+	this->w = w;
+	this->h = h;
+	offset_image = statcache_round(sizeof(statcache_header));
+	offset_sum1  = offset_image + statcache_round(size_t(w) * size_t(h));
+	offset_sum2  = offset_sum1  + statcache_round(plane);
+	mapsize      = offset_sum2  + statcache_round(plane);
+	return true;
+}
+
+bool statcache::open(const char* filename, const statcache_key& key)
+{
+	close();
+	fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	statcache_header hdr;
+	struct stat st;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != ssize_t(sizeof(hdr))
+		|| memcmp(hdr.magic, statcache_magic, sizeof(hdr.magic)) != 0
+		|| hdr.byte_order != statcache_byte_order
+		|| memcmp(&hdr.key, &key, sizeof(key)) != 0
+		|| !layout(key, hdr.width, hdr.height)
+		|| fstat(fd, &st) != 0
+		|| size_t(st.st_size) != mapsize)
+	{
+		close();
+		return false;
+	}
+	map = mmap(nullptr, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		map = nullptr;
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool statcache::create(const char* filename, const statcache_key& key, int w, int h)
+{
+	close();
+	if (!layout(key, w, h))
+		return false;
+	std::string tmp = std::string(filename) + ".XXXXXX";
+	fd = mkstemp(&tmp[0]);
+	if (fd < 0)
+		return false;
+	target = filename;
+	temporary = tmp;
+	mode_t mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, 0644 & ~mask) != 0 || ftruncate(fd, off_t(mapsize)) != 0)
+	{
+		close();
+		return false;
+	}
+	map = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		map = nullptr;
+		close();
+		return false;
+	}
+	statcache_header* hdr = (statcache_header*)map;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->byte_order = statcache_byte_order;
+	hdr->width  = w;
+	hdr->height = h;
+	hdr->key    = key;
+	return true;
+}
+
+void statcache::commit()
+{
+	if (!map || temporary.empty())
+		return;
+	memcpy(((statcache_header*)map)->magic, statcache_magic, sizeof(statcache_magic));
+	if (rename(temporary.c_str(), target.c_str()) == 0)
+		temporary.clear();
+}
+
+void statcache::close()
+{
+	if (map)
+		munmap(map, mapsize);
+	if (fd >= 0)
+		::close(fd);
+	// Created but not committed
+	if (!temporary.empty())
+		unlink(temporary.c_str());
+	target.clear();
+	temporary.clear();
+	fd = -1;
+	map = nullptr;
+	mapsize = 0;
+	w = h = 0;
+}
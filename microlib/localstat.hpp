@@ -0,0 +1,1223 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Local Window Statistics Engines
+
+	localstat.hpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+#ifndef IMGPROC_DH_MICROLIB_LOCALSTAT_HPP
+#define IMGPROC_DH_MICROLIB_LOCALSTAT_HPP
+
+/*
+	Each engine computes, for every pixel of a grayscale image, the sum and
+	the sum of squares over a square window (with replicated borders).
+	The window for (y, x) covers rows [y + 1 - win_n, y + win_p] and
+	columns [x + 1 - win_n, x + win_p] where win_n = ceil(wsize / 2) and
+	win_p = floor(wsize / 2), which matches the original implementation
+	using copyMakeBorder.
+
+	Results are handed over row by row: func(y, sum1, sum2) is called
+	once for each row with w elements each. Rows are split into bands when
+	multiple threads are used; func is called concurrently from different
+	bands (in increasing order within each band).
+
+	T is an unsigned integer type. Engines only add, subtract and multiply,
+	so window sums are exact (modulo 2^N) as long as the sum of squares of a
+	single window fits in T, even if integral images themselves overflow.
+
+	src is an 8-bit grayscale or BGR image. Luminance of BGR images is
+	computed row by row while accumulating (see localstat_row), so that no
+	grayscale copy of the whole image is needed.
+
+	The localstat_run* functions return false if the image is empty or the
+	padded image (or a buffer for it) cannot be allocated.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#define LOCALSTAT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+enum localstat_engine
+{
+	LOCALSTAT_ENGINE_INTEGRAL,
+	LOCALSTAT_ENGINE_STREAM,
+	LOCALSTAT_ENGINE_CLAMPED,
+	LOCALSTAT_ENGINE_COLUMN,
+	LOCALSTAT_ENGINE_INTERLEAVED,
+};
+
+/*
+	Row y of src as grayscale: rows of grayscale images are returned as is,
+	and luminance of BGR images is computed into buf (src.cols elements)
+	with the fixed-point coefficients of cv::cvtColor (COLOR_BGR2GRAY),
+	so that the result is identical to a converted image.
+*/
+inline const unsigned char* localstat_row(const cv::Mat& src, int y, unsigned char* buf)
+{
+	const unsigned char* p = src.ptr<unsigned char>(y);
+	if (src.channels() == 1)
+		return p;
+	for (int x = 0; x < src.cols; x++, p += 3)
+		buf[x] = (unsigned char)((p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + 8192) >> 14);
+	return buf;
+}
+
+/*
+	Call func(i0, i1) for (at most) nthreads contiguous parts of [0, n)
+	in parallel. nthreads <= 0 means the number of CPUs.
+	An exception thrown by func is rethrown here after all parts finish.
+*/
+template <typename F>
+void localstat_parallel(int nthreads, int n, F func)
+{
+	if (nthreads <= 0)
+		nthreads = std::max(1u, std::thread::hardware_concurrency());
+	nthreads = std::max(1, std::min(nthreads, n));
+	if (nthreads == 1)
+	{
+		func(0, n);
+		return;
+	}
+	std::vector<std::exception_ptr> errors(nthreads);
+	auto part = [&](int i)
+	{
+		try
+		{
+			func(int((long long)n * i / nthreads), int((long long)n * (i + 1) / nthreads));
+		}
+		catch (...)
+		{
+			errors[i] = std::current_exception();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 1; i < nthreads; i++)
+		threads.emplace_back(part, i);
+	part(0);
+	for (auto& t : threads)
+		t.join();
+	for (auto& e : errors)
+		if (e)
+			std::rethrow_exception(e);
+}
+
+#ifdef LOCALSTAT_SSE2
+/*
+	SSE2 prefix sums of 16 pixels at a time: values (and their squares,
+	exact in 16 bits) are widened to the lanes of T, summed in-register by
+	shift-and-add, and the running totals (carry) are broadcast to all lanes.
+*/
+inline __m128i localstat_set1(uint_least32_t v) { return _mm_set1_epi32(int(v)); }
+inline __m128i localstat_set1(uint_least64_t v) { return _mm_set1_epi64x((long long)v); }
+inline __m128i localstat_add(__m128i a, __m128i b, const uint_least32_t*) { return _mm_add_epi32(a, b); }
+inline __m128i localstat_add(__m128i a, __m128i b, const uint_least64_t*) { return _mm_add_epi64(a, b); }
+
+inline __m128i localstat_scan(__m128i v, __m128i& carry, const uint_least32_t*)
+{
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+	v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+	v = _mm_add_epi32(v, carry);
+	carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+	return v;
+}
+
+inline __m128i localstat_scan(__m128i v, __m128i& carry, const uint_least64_t*)
+{
+	v = _mm_add_epi64(v, _mm_slli_si128(v, 8));
+	v = _mm_add_epi64(v, carry);
+	carry = _mm_unpackhi_epi64(v, v);
+	return v;
+}
+
+// Four 32-bit lanes as vectors of T
+inline void localstat_widen(__m128i v, __m128i* out, const uint_least32_t*)
+{
+	out[0] = v;
+}
+
+inline void localstat_widen(__m128i v, __m128i* out, const uint_least64_t*)
+{
+	out[0] = _mm_unpacklo_epi32(v, _mm_setzero_si128());
+	out[1] = _mm_unpackhi_epi32(v, _mm_setzero_si128());
+}
+
+// Pairs of (a, b) for interleaved buffers
+inline void localstat_interleave(__m128i a, __m128i b, __m128i& lo, __m128i& hi, const uint_least32_t*)
+{
+	lo = _mm_unpacklo_epi32(a, b);
+	hi = _mm_unpackhi_epi32(a, b);
+}
+
+inline void localstat_interleave(__m128i a, __m128i b, __m128i& lo, __m128i& hi, const uint_least64_t*)
+{
+	lo = _mm_unpacklo_epi64(a, b);
+	hi = _mm_unpackhi_epi64(a, b);
+}
+
+template <typename T, int S, bool Squares>
+int localstat_prefix_sse2(T* b1, T* b2, const T* prev1, const T* prev2,
+	const unsigned char* p, int n, T& accum1, T& accum2)
+{
+	const int L = 16 / sizeof(T); // lanes
+	const T* tag = nullptr;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c1 = localstat_set1(accum1);
+	__m128i c2 = localstat_set1(accum2);
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v8 = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i v[16 / L], q[16 / L];
+		for (int h = 0; h < 2; h++)
+		{
+			__m128i v16 = h ? _mm_unpackhi_epi8(v8, zero) : _mm_unpacklo_epi8(v8, zero);
+			__m128i q16 = _mm_mullo_epi16(v16, v16);
+			localstat_widen(_mm_unpacklo_epi16(v16, zero), v + (2 * h    ) * (4 / L), tag);
+			localstat_widen(_mm_unpackhi_epi16(v16, zero), v + (2 * h + 1) * (4 / L), tag);
+			if (Squares)
+			{
+				localstat_widen(_mm_unpacklo_epi16(q16, zero), q + (2 * h    ) * (4 / L), tag);
+				localstat_widen(_mm_unpackhi_epi16(q16, zero), q + (2 * h + 1) * (4 / L), tag);
+			}
+		}
+		for (int j = 0; j < 16 / L; j++)
+		{
+			size_t x = size_t(i + j * L) * S;
+			__m128i s1 = localstat_scan(v[j], c1, tag);
+			__m128i s2 = Squares ? localstat_scan(q[j], c2, tag) : zero;
+			if (S == 1)
+			{
+				if (prev1)
+					s1 = localstat_add(s1, _mm_loadu_si128((const __m128i*)(prev1 + x)), tag);
+				_mm_storeu_si128((__m128i*)(b1 + x), s1);
+				if (Squares)
+				{
+					if (prev2)
+						s2 = localstat_add(s2, _mm_loadu_si128((const __m128i*)(prev2 + x)), tag);
+					_mm_storeu_si128((__m128i*)(b2 + x), s2);
+				}
+			}
+			else
+			{
+				// b2 == b1 + 1 (and prev2 == prev1 + 1)
+				__m128i lo, hi;
+				localstat_interleave(s1, s2, lo, hi, tag);
+				if (prev1)
+				{
+					lo = localstat_add(lo, _mm_loadu_si128((const __m128i*)(prev1 + x    )), tag);
+					hi = localstat_add(hi, _mm_loadu_si128((const __m128i*)(prev1 + x + L)), tag);
+				}
+				_mm_storeu_si128((__m128i*)(b1 + x    ), lo);
+				_mm_storeu_si128((__m128i*)(b1 + x + L), hi);
+			}
+		}
+	}
+	T carry[L];
+	_mm_storeu_si128((__m128i*)carry, c1);
+	accum1 = carry[0];
+	_mm_storeu_si128((__m128i*)carry, c2);
+	accum2 = carry[0];
+	return i;
+}
+#endif
+
+// Leading pixels of a row processed by SIMD (none for other types)
+template <typename T, int S, bool Squares>
+int localstat_prefix_simd(T*, T*, const T*, const T*, const unsigned char*, int, T&, T&)
+{
+	return 0;
+}
+
+#ifdef LOCALSTAT_SSE2
+template <typename T, int S, bool Squares>
+int localstat_prefix_simd(uint_least32_t* b1, uint_least32_t* b2, const uint_least32_t* prev1, const uint_least32_t* prev2,
+	const unsigned char* p, int n, uint_least32_t& accum1, uint_least32_t& accum2)
+{
+	if (S == 2 && !Squares)
+		return 0;
+	return localstat_prefix_sse2<uint_least32_t, S, Squares>(b1, b2, prev1, prev2, p, n, accum1, accum2);
+}
+
+template <typename T, int S, bool Squares>
+int localstat_prefix_simd(uint_least64_t* b1, uint_least64_t* b2, const uint_least64_t* prev1, const uint_least64_t* prev2,
+	const unsigned char* p, int n, uint_least64_t& accum1, uint_least64_t& accum2)
+{
+	if (S == 2 && !Squares)
+		return 0;
+	return localstat_prefix_sse2<uint_least64_t, S, Squares>(b1, b2, prev1, prev2, p, n, accum1, accum2);
+}
+#endif
+
+/*
+	Horizontal prefix sums of a row of src padded by pad pixels
+	(replicating borders), plus the previous row of the integral images
+	(prev1 and prev2) unless they are null.
+	Unpadded pixels are summed with SIMD.
+*/
+template <typename T, int S, bool Squares>
+void localstat_prefix_row(T* b1, T* b2, const T* prev1, const T* prev2,
+	const unsigned char* p, int w, int pad, int bw)
+{
+	T accum1 = 0;
+	T accum2 = 0;
+	auto scalar = [&](int x0, int x1)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			T value = p[std::min(std::max(x - pad, 0), w - 1)];
+			accum1 += value;
+			b1[size_t(x) * S] = prev1 ? accum1 + prev1[size_t(x) * S] : accum1;
+			if (Squares)
+			{
+				accum2 += value * value;
+				b2[size_t(x) * S] = prev2 ? accum2 + prev2[size_t(x) * S] : accum2;
+			}
+		}
+	};
+	int x0 = std::min(pad, bw);
+	int x1 = std::min(pad + w, bw);
+	scalar(0, x0);
+	size_t off = size_t(x0) * S;
+	int n = localstat_prefix_simd<T, S, Squares>(b1 + off, Squares ? b2 + off : nullptr,
+		prev1 ? prev1 + off : nullptr, prev2 ? prev2 + off : nullptr, p + (x0 - pad), x1 - x0, accum1, accum2);
+	scalar(x0 + n, bw);
+}
+
+/*
+	Integral images (bw * bh elements each) of src padded by pad pixels
+	(replicating borders) at the top and the left.
+	Element (y, x) is at buffer[(bw * y + x) * S]
+	(S = 2 interleaves both images in a single buffer).
+	Without Squares, only buffer1 (sums of values) is built
+	and buffer2 is not touched.
+	Each row is computed from the previous one while in cache. With
+	multiple threads, each band of rows is computed independently, and
+	the totals of previous bands (carried through the last rows of bands)
+	are added afterwards.
+*/
+template <typename T, int S = 1, bool Squares = true>
+void localstat_build_integral(T* buffer1, T* buffer2, const cv::Mat& src, int pad, int bw, int bh, int nthreads)
+{
+	int w = src.cols;
+	int h = src.rows;
+	size_t stride = size_t(bw) * S;
+	auto row = [&](int y, bool accumulate, unsigned char* gray)
+	{
+		const unsigned char* p = localstat_row(src, std::min(std::max(y - pad, 0), h - 1), gray);
+		T* b1 = buffer1 + stride * y;
+		T* b2 = Squares ? buffer2 + stride * y : nullptr;
+		bool prev = accumulate && y > 0;
+		localstat_prefix_row<T, S, Squares>(b1, b2, prev ? b1 - stride : nullptr,
+			prev && Squares ? b2 - stride : nullptr, p, w, pad, bw);
+	};
+	if (nthreads <= 0)
+		nthreads = std::max(1u, std::thread::hardware_concurrency());
+	int nbands = std::max(1, std::min(nthreads, bh));
+	auto band = [&](int i)
+	{
+		return int((long long)bh * i / nbands);
+	};
+	localstat_parallel(nbands, nbands, [&](int i0, int i1)
+	{
+		std::vector<unsigned char> gray(src.channels() == 1 ? 0 : w);
+		for (int i = i0; i < i1; i++)
+			for (int y = band(i); y < band(i + 1); y++)
+				row(y, y > band(i), gray.data());
+	});
+	if (nbands == 1)
+		return;
+	// Add row g (total of previous bands) to row y
+	auto add = [&](int y, int g)
+	{
+		T* b1 = buffer1 + stride * y;
+		const T* g1 = buffer1 + stride * g;
+		if (S == 2 && Squares)
+		{
+			// Both images at once (buffer2 == buffer1 + 1)
+			for (size_t x = 0; x < stride; x++)
+				b1[x] += g1[x];
+			return;
+		}
+		T* b2 = Squares ? buffer2 + stride * y : nullptr;
+		const T* g2 = Squares ? buffer2 + stride * g : nullptr;
+		for (int x = 0; x < bw; x++)
+		{
+			b1[size_t(x) * S] += g1[size_t(x) * S];
+			if (Squares)
+				b2[size_t(x) * S] += g2[size_t(x) * S];
+		}
+	};
+	for (int i = 1; i < nbands; i++)
+		add(band(i + 1) - 1, band(i) - 1);
+	localstat_parallel(nbands, nbands - 1, [&](int i0, int i1)
+	{
+		for (int i = i0 + 1; i < i1 + 1; i++)
+			for (int y = band(i); y < band(i + 1) - 1; y++)
+				add(y, band(i) - 1);
+	});
+}
+
+/*
+	Shafait et al. (2008):
+	Two integral images of the padded image (whole page).
+*/
+template <typename T>
+class localstat_integral
+{
+	int w, h, pw, ph, wsize, win_n;
+	std::vector<T> buffer1;
+	std::vector<T> buffer2;
+	// Window sums of a row for a window not larger than wsize
+	void window(int y, int ws, T* sum1, T* sum2) const
+	{
+		int off = win_n - (ws / 2 + ws % 2);
+		const T* b1y0 = buffer1.data() + size_t(pw) * (y + off) + off;
+		const T* b2y0 = buffer2.data() + size_t(pw) * (y + off) + off;
+		const T* b1y1 = buffer1.data() + size_t(pw) * (y + off + ws) + off;
+		const T* b2y1 = buffer2.data() + size_t(pw) * (y + off + ws) + off;
+		for (int x = 0; x < w; x++)
+		{
+			sum1[x] = b1y1[x + ws] - b1y1[x] + b1y0[x] - b1y0[x + ws];
+			sum2[x] = b2y1[x + ws] - b2y1[x] + b2y0[x] - b2y0[x + ws];
+		}
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, int nthreads = 1)
+	{
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		win_n = wsize / 2;
+		if ((wsize % 2) != 0)
+			++win_n;
+		if (
+			src.empty() ||
+			std::numeric_limits<int>::max() - wsize < w ||
+			std::numeric_limits<int>::max() - wsize < h
+		)
+		{
+			return false;
+		}
+		pw = w + wsize;
+		ph = h + wsize;
+		buffer1.resize(size_t(pw) * ph);
+		buffer2.resize(size_t(pw) * ph);
+		localstat_build_integral(buffer1.data(), buffer2.data(), src, win_n, pw, ph, nthreads);
+		return true;
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		std::vector<T> sum1(w), sum2(w);
+		for (int y = y0; y < y1; y++)
+		{
+			window(y, wsize, sum1.data(), sum2.data());
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+	template <typename F>
+	void rows(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		size_t n = wsizes.size();
+		std::vector<T> sum1(n * w), sum2(n * w);
+		for (int y = y0; y < y1; y++)
+		{
+			for (size_t i = 0; i < n; i++)
+				window(y, wsizes[i], sum1.data() + i * w, sum2.data() + i * w);
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+};
+
+/*
+	Same as localstat_integral but with the integral image of values only
+	(func(y, sum1) gets window sums without sums of squares).
+	Window sums of values stay exact in T for much larger windows.
+*/
+template <typename T>
+class localstat_integral_mean
+{
+	int w, h, pw, ph, wsize, win_n;
+	std::vector<T> buffer1;
+public:
+	bool prepare(const cv::Mat& src, int wsize, int nthreads = 1)
+	{
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		win_n = wsize / 2;
+		if ((wsize % 2) != 0)
+			++win_n;
+		if (
+			src.empty() ||
+			std::numeric_limits<int>::max() - wsize < w ||
+			std::numeric_limits<int>::max() - wsize < h
+		)
+		{
+			return false;
+		}
+		pw = w + wsize;
+		ph = h + wsize;
+		buffer1.resize(size_t(pw) * ph);
+		localstat_build_integral<T, 1, false>(buffer1.data(), nullptr, src, win_n, pw, ph, nthreads);
+		return true;
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		std::vector<T> sum1(w);
+		for (int y = y0; y < y1; y++)
+		{
+			const T* b1y0 = buffer1.data() + size_t(pw) * y;
+			const T* b1y1 = buffer1.data() + size_t(pw) * (y + wsize);
+			for (int x = 0; x < w; x++)
+				sum1[x] = b1y1[x + wsize] - b1y1[x] + b1y0[x] - b1y0[x + wsize];
+			func(y, sum1.data());
+		}
+	}
+};
+
+/*
+	Same as localstat_integral but both integral images are interleaved
+	in a single buffer (each corner lookup reads one cache line).
+*/
+template <typename T>
+class localstat_interleaved
+{
+	int w, h, pw, ph, wsize, win_n;
+	std::vector<T> buffer;
+	// Window sums of a row for a window not larger than wsize
+	void window(int y, int ws, T* sum1, T* sum2) const
+	{
+		int off = win_n - (ws / 2 + ws % 2);
+		const T* by0 = buffer.data() + (size_t(pw) * (y + off) + off) * 2;
+		const T* by1 = buffer.data() + (size_t(pw) * (y + off + ws) + off) * 2;
+		for (int x = 0; x < w; x++)
+		{
+			const T* c00 = by0 + size_t(x) * 2;
+			const T* c01 = by0 + size_t(x + ws) * 2;
+			const T* c10 = by1 + size_t(x) * 2;
+			const T* c11 = by1 + size_t(x + ws) * 2;
+			sum1[x] = c11[0] - c10[0] + c00[0] - c01[0];
+			sum2[x] = c11[1] - c10[1] + c00[1] - c01[1];
+		}
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, int nthreads = 1)
+	{
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		win_n = wsize / 2;
+		if ((wsize % 2) != 0)
+			++win_n;
+		if (
+			src.empty() ||
+			std::numeric_limits<int>::max() - wsize < w ||
+			std::numeric_limits<int>::max() - wsize < h
+		)
+		{
+			return false;
+		}
+		pw = w + wsize;
+		ph = h + wsize;
+		buffer.resize(size_t(pw) * ph * 2);
+		localstat_build_integral<T, 2>(buffer.data(), buffer.data() + 1, src, win_n, pw, ph, nthreads);
+		return true;
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		std::vector<T> sum1(w), sum2(w);
+		for (int y = y0; y < y1; y++)
+		{
+			window(y, wsize, sum1.data(), sum2.data());
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+	template <typename F>
+	void rows(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		size_t n = wsizes.size();
+		std::vector<T> sum1(n * w), sum2(n * w);
+		for (int y = y0; y < y1; y++)
+		{
+			for (size_t i = 0; i < n; i++)
+				window(y, wsizes[i], sum1.data() + i * w, sum2.data() + i * w);
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+};
+
+/*
+	Streaming variant of the above:
+	Only a ring of (wsize + 1) integral rows is kept. Since window sums are
+	differences of two integral rows, accumulation may start from any row.
+	Memory usage is proportional to (w + wsize) * (wsize + 1).
+*/
+template <typename T>
+class localstat_stream
+{
+	const cv::Mat* src;
+	int w, h, pw, wsize, win_n;
+	template <typename F>
+	void rows_impl(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		int nring = wsize + 1;
+		size_t n = wsizes.size();
+		std::vector<T> ring1(size_t(pw) * nring), ring2(size_t(pw) * nring);
+		std::vector<T> sum1(n * w), sum2(n * w);
+		std::vector<unsigned char> gray(src->channels() == 1 ? 0 : w);
+		// Accumulate padded row y onto padded row (y - 1)
+		auto accumulate = [&](int y)
+		{
+			const unsigned char* p = localstat_row(*src, std::min(std::max(y - win_n, 0), h - 1), gray.data());
+			T* r1 = ring1.data() + size_t(pw) * (y % nring);
+			T* r2 = ring2.data() + size_t(pw) * (y % nring);
+			const T* q1 = ring1.data() + size_t(pw) * ((y - 1) % nring);
+			const T* q2 = ring2.data() + size_t(pw) * ((y - 1) % nring);
+			T accum1 = 0;
+			T accum2 = 0;
+			for (int x = 0; x < pw; x++)
+			{
+				T value = p[std::min(std::max(x - win_n, 0), w - 1)];
+				accum1 += value;
+				accum2 += value * value;
+				r1[x] = accum1 + q1[x];
+				r2[x] = accum2 + q2[x];
+			}
+		};
+		std::fill(ring1.begin() + size_t(pw) * (y0 % nring), ring1.begin() + size_t(pw) * (y0 % nring + 1), T(0));
+		std::fill(ring2.begin() + size_t(pw) * (y0 % nring), ring2.begin() + size_t(pw) * (y0 % nring + 1), T(0));
+		for (int y = y0 + 1; y < y0 + wsize; y++)
+			accumulate(y);
+		for (int y = y0; y < y1; y++)
+		{
+			accumulate(y + wsize);
+			for (size_t i = 0; i < n; i++)
+			{
+				int ws = wsizes[i];
+				int off = win_n - (ws / 2 + ws % 2);
+				const T* b1y0 = ring1.data() + size_t(pw) * ((y + off) % nring) + off;
+				const T* b2y0 = ring2.data() + size_t(pw) * ((y + off) % nring) + off;
+				const T* b1y1 = ring1.data() + size_t(pw) * ((y + off + ws) % nring) + off;
+				const T* b2y1 = ring2.data() + size_t(pw) * ((y + off + ws) % nring) + off;
+				T* s1 = sum1.data() + i * w;
+				T* s2 = sum2.data() + i * w;
+				for (int x = 0; x < w; x++)
+				{
+					s1[x] = b1y1[x + ws] - b1y1[x] + b1y0[x] - b1y0[x + ws];
+					s2[x] = b2y1[x + ws] - b2y1[x] + b2y0[x] - b2y0[x + ws];
+				}
+			}
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, int /*nthreads*/ = 1)
+	{
+		this->src = &src;
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		win_n = wsize / 2;
+		if ((wsize % 2) != 0)
+			++win_n;
+		if (
+			src.empty() ||
+			std::numeric_limits<int>::max() - wsize < w
+		)
+		{
+			return false;
+		}
+		pw = w + wsize;
+		return true;
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		rows_impl(y0, y1, std::vector<int>(1, wsize), func);
+	}
+	template <typename F>
+	void rows(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		rows_impl(y0, y1, wsizes, func);
+	}
+};
+
+/*
+	Padding-free integral images (exactly w * h elements each):
+	Replicated borders are accounted analytically by weighting the first and
+	the last row/column by the number of out-of-range rows/columns.
+*/
+template <typename T>
+class localstat_clamped
+{
+	int w, h, wsize;
+	std::vector<T> buffer1;
+	std::vector<T> buffer2;
+	// col1/col2: work area of w elements each
+	void window(int y, int ws, T* col1, T* col2, T* sum1, T* sum2) const
+	{
+		int win_n = ws / 2 + ws % 2;
+		int win_p = ws / 2;
+		// Vertical window sums as horizontal prefix sums
+		int lo = y + 1 - win_n;
+		int hi = y + win_p;
+		int r0 = std::max(lo, 0);
+		int r1 = std::min(hi, h - 1);
+		T et = r0 - lo;
+		T eb = hi - r1;
+		const T* b1r1 = buffer1.data() + size_t(w) * r1;
+		const T* b2r1 = buffer2.data() + size_t(w) * r1;
+		const T* b1r0 = r0 ? buffer1.data() + size_t(w) * (r0 - 1) : nullptr;
+		const T* b2r0 = r0 ? buffer2.data() + size_t(w) * (r0 - 1) : nullptr;
+		const T* b1l0 = buffer1.data() + size_t(w) * (h - 1);
+		const T* b2l0 = buffer2.data() + size_t(w) * (h - 1);
+		const T* b1l1 = h > 1 ? b1l0 - w : nullptr;
+		const T* b2l1 = h > 1 ? b2l0 - w : nullptr;
+		for (int x = 0; x < w; x++)
+		{
+			T v1 = b1r1[x];
+			T v2 = b2r1[x];
+			if (b1r0)
+			{
+				v1 -= b1r0[x];
+				v2 -= b2r0[x];
+			}
+			if (et)
+			{
+				v1 += et * buffer1[x];
+				v2 += et * buffer2[x];
+			}
+			if (eb)
+			{
+				v1 += eb * (b1l1 ? b1l0[x] - b1l1[x] : b1l0[x]);
+				v2 += eb * (b2l1 ? b2l0[x] - b2l1[x] : b2l0[x]);
+			}
+			col1[x] = v1;
+			col2[x] = v2;
+		}
+		// Horizontal window
+		T first1 = col1[0];
+		T first2 = col2[0];
+		T last1 = w > 1 ? col1[w - 1] - col1[w - 2] : col1[0];
+		T last2 = w > 1 ? col2[w - 1] - col2[w - 2] : col2[0];
+		for (int x = 0; x < w; x++)
+		{
+			int c0 = x + 1 - win_n;
+			int c1 = x + win_p;
+			if (c0 > 0 && c1 < w)
+			{
+				sum1[x] = col1[c1] - col1[c0 - 1];
+				sum2[x] = col2[c1] - col2[c0 - 1];
+				continue;
+			}
+			T el = c0 < 0 ? T(-c0) : T(0);
+			T er = c1 >= w ? T(c1 - (w - 1)) : T(0);
+			c0 = std::max(c0, 0);
+			c1 = std::min(c1, w - 1);
+			T v1 = col1[c1] + el * first1 + er * last1;
+			T v2 = col2[c1] + el * first2 + er * last2;
+			if (c0)
+			{
+				v1 -= col1[c0 - 1];
+				v2 -= col2[c0 - 1];
+			}
+			sum1[x] = v1;
+			sum2[x] = v2;
+		}
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, int nthreads = 1)
+	{
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		if (src.empty())
+			return false;
+		buffer1.resize(size_t(w) * h);
+		buffer2.resize(size_t(w) * h);
+		localstat_build_integral(buffer1.data(), buffer2.data(), src, 0, w, h, nthreads);
+		return true;
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		std::vector<T> col1(w), col2(w);
+		std::vector<T> sum1(w), sum2(w);
+		for (int y = y0; y < y1; y++)
+		{
+			window(y, wsize, col1.data(), col2.data(), sum1.data(), sum2.data());
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+	template <typename F>
+	void rows(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		size_t n = wsizes.size();
+		std::vector<T> col1(w), col2(w);
+		std::vector<T> sum1(n * w), sum2(n * w);
+		for (int y = y0; y < y1; y++)
+		{
+			for (size_t i = 0; i < n; i++)
+				window(y, wsizes[i], col1.data(), col2.data(), sum1.data() + i * w, sum2.data() + i * w);
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+};
+
+/*
+	Integral-free sliding window:
+	Per-column sums over the vertical window are updated by one row in and
+	one row out, and the horizontal window slides along each row.
+	O(1) work per pixel with O(w) state (per window size).
+*/
+template <typename T>
+class localstat_column
+{
+	const cv::Mat* src;
+	int w, h, wsize;
+	struct column_sums
+	{
+		int win_n, win_p;
+		std::vector<T> col1, col2;
+	};
+	void add_row(column_sums& c, int y, T n, unsigned char* gray) const
+	{
+		const unsigned char* p = localstat_row(*src, y, gray);
+		for (int x = 0; x < w; x++)
+		{
+			T value = p[x];
+			c.col1[x] += n * value;
+			c.col2[x] += n * value * value;
+		}
+	}
+	void sub_row(column_sums& c, int y, unsigned char* gray) const
+	{
+		const unsigned char* p = localstat_row(*src, y, gray);
+		for (int x = 0; x < w; x++)
+		{
+			T value = p[x];
+			c.col1[x] -= value;
+			c.col2[x] -= value * value;
+		}
+	}
+	template <typename F>
+	void rows_impl(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		size_t n = wsizes.size();
+		std::vector<column_sums> cols(n);
+		std::vector<T> sum1(n * w), sum2(n * w);
+		std::vector<unsigned char> gray(src->channels() == 1 ? 0 : w);
+		// Vertical windows for the first row
+		for (size_t i = 0; i < n; i++)
+		{
+			column_sums& c = cols[i];
+			c.win_n = wsizes[i] / 2 + wsizes[i] % 2;
+			c.win_p = wsizes[i] / 2;
+			c.col1.assign(w, T(0));
+			c.col2.assign(w, T(0));
+			int lo = y0 + 1 - c.win_n;
+			int hi = y0 + c.win_p;
+			int r0 = std::max(lo, 0);
+			int r1 = std::min(hi, h - 1);
+			for (int y = r0; y <= r1; y++)
+				add_row(c, y, 1, gray.data());
+			if (r0 - lo)
+				add_row(c, 0, r0 - lo, gray.data());
+			if (hi - r1)
+				add_row(c, h - 1, hi - r1, gray.data());
+		}
+		for (int y = y0; y < y1; y++)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				column_sums& c = cols[i];
+				const T* col1 = c.col1.data();
+				const T* col2 = c.col2.data();
+				T* s1 = sum1.data() + i * w;
+				T* s2 = sum2.data() + i * w;
+				if (y != y0)
+				{
+					add_row(c, std::min(y + c.win_p, h - 1), 1, gray.data());
+					sub_row(c, std::max(y - c.win_n, 0), gray.data());
+				}
+				// Number of replicated columns for the first pixel of a row
+				int c1 = std::min(c.win_p, w - 1);
+				T el = c.win_n - 1;
+				T er = c.win_p - c1;
+				T accum1 = el * col1[0] + er * col1[w - 1];
+				T accum2 = el * col2[0] + er * col2[w - 1];
+				for (int x = 0; x <= c1; x++)
+				{
+					accum1 += col1[x];
+					accum2 += col2[x];
+				}
+				s1[0] = accum1;
+				s2[0] = accum2;
+				for (int x = 1; x < w; x++)
+				{
+					int xi = std::min(x + c.win_p, w - 1);
+					int xo = std::max(x - c.win_n, 0);
+					accum1 += col1[xi] - col1[xo];
+					accum2 += col2[xi] - col2[xo];
+					s1[x] = accum1;
+					s2[x] = accum2;
+				}
+			}
+			func(y, sum1.data(), sum2.data());
+		}
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, int /*nthreads*/ = 1)
+	{
+		this->src = &src;
+		w = src.cols;
+		h = src.rows;
+		this->wsize = wsize;
+		return !src.empty();
+	}
+	template <typename F>
+	void rows(int y0, int y1, F func) const
+	{
+		rows_impl(y0, y1, std::vector<int>(1, wsize), func);
+	}
+	template <typename F>
+	void rows(int y0, int y1, const std::vector<int>& wsizes, F func) const
+	{
+		rows_impl(y0, y1, wsizes, func);
+	}
+};
+
+/*
+	Window sums of sparse points only (rows ys times columns xs, ascending),
+	identical to those of localstat_integral (same padded corners).
+	Instead of whole-page integral images, column sums are accumulated down
+	the page (bands of columns in parallel) and only elements of integral
+	images at corners of the windows are kept.
+*/
+template <typename T>
+class localstat_points
+{
+	std::vector<size_t> top, bottom, left, right; // indices of corners
+	size_t ncols;
+	std::vector<T> corner1, corner2;
+	// Sorted corners (y and y + wsize) of points, and index of each one
+	static std::vector<int> corners(const std::vector<int>& points, int wsize,
+		std::vector<size_t>& lo, std::vector<size_t>& hi)
+	{
+		std::vector<int> c;
+		for (int p : points)
+		{
+			c.push_back(p);
+			c.push_back(p + wsize);
+		}
+		std::sort(c.begin(), c.end());
+		c.erase(std::unique(c.begin(), c.end()), c.end());
+		for (int p : points)
+		{
+			lo.push_back(std::lower_bound(c.begin(), c.end(), p) - c.begin());
+			hi.push_back(std::lower_bound(c.begin(), c.end(), p + wsize) - c.begin());
+		}
+		return c;
+	}
+public:
+	bool prepare(const cv::Mat& src, int wsize, const std::vector<int>& ys, const std::vector<int>& xs, int nthreads = 1)
+	{
+		int w = src.cols;
+		int h = src.rows;
+		int win_n = wsize / 2 + wsize % 2;
+		if (
+			src.empty() ||
+			std::numeric_limits<int>::max() - wsize < w ||
+			std::numeric_limits<int>::max() - wsize < h
+		)
+		{
+			return false;
+		}
+		std::vector<int> rows = corners(ys, wsize, top, bottom);
+		std::vector<int> cols = corners(xs, wsize, left, right);
+		size_t nrows = rows.size();
+		ncols = cols.size();
+		// Column sums of padded rows up to each corner row
+		std::vector<T> col1(nrows * w), col2(nrows * w);
+		localstat_parallel(nthreads, w, [&](int x0, int x1)
+		{
+			cv::Mat band = src.colRange(x0, x1);
+			int bw = x1 - x0;
+			std::vector<T> sum1(bw), sum2(bw);
+			std::vector<unsigned char> gray(src.channels() == 1 ? 0 : bw);
+			size_t k = 0;
+			for (int y = 0; k < nrows; y++)
+			{
+				const unsigned char* p = localstat_row(band, std::min(std::max(y - win_n, 0), h - 1), gray.data());
+				for (int x = 0; x < bw; x++)
+				{
+					T value = p[x];
+					sum1[x] += value;
+					sum2[x] += value * value;
+				}
+				for (; k < nrows && rows[k] == y; k++)
+				{
+					std::copy(sum1.begin(), sum1.end(), col1.begin() + k * w + x0);
+					std::copy(sum2.begin(), sum2.end(), col2.begin() + k * w + x0);
+				}
+			}
+		});
+		// Horizontal prefix sums of them up to each corner column
+		corner1.resize(nrows * ncols);
+		corner2.resize(nrows * ncols);
+		localstat_parallel(nthreads, nrows, [&](int k0, int k1)
+		{
+			for (int k = k0; k < k1; k++)
+			{
+				const T* c1 = col1.data() + size_t(k) * w;
+				const T* c2 = col2.data() + size_t(k) * w;
+				T accum1 = 0;
+				T accum2 = 0;
+				size_t c = 0;
+				for (int x = 0; c < ncols; x++)
+				{
+					int sx = std::min(std::max(x - win_n, 0), w - 1);
+					accum1 += c1[sx];
+					accum2 += c2[sx];
+					for (; c < ncols && cols[c] == x; c++)
+					{
+						corner1[k * ncols + c] = accum1;
+						corner2[k * ncols + c] = accum2;
+					}
+				}
+			}
+		});
+		return true;
+	}
+	// Window sums of point (xs[i], ys[j])
+	void at(size_t j, size_t i, T& sum1, T& sum2) const
+	{
+		size_t t = top[j] * ncols, b = bottom[j] * ncols;
+		sum1 = corner1[b + right[i]] - corner1[b + left[i]] + corner1[t + left[i]] - corner1[t + right[i]];
+		sum2 = corner2[b + right[i]] - corner2[b + left[i]] + corner2[t + left[i]] - corner2[t + right[i]];
+	}
+};
+
+
+
+template <typename E, typename F>
+bool localstat_run_engine(E& e, const cv::Mat& src, int wsize, int nthreads, F func)
+{
+	try
+	{
+		if (!e.prepare(src, wsize, nthreads))
+			return false;
+		localstat_parallel(nthreads, src.rows, [&](int y0, int y1)
+		{
+			e.rows(y0, y1, func);
+		});
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+	catch (const std::length_error&)
+	{
+		return false;
+	}
+	return true;
+}
+
+template <typename T, typename F>
+bool localstat_run(localstat_engine engine, const cv::Mat& src, int wsize, F func, int nthreads = 1)
+{
+	switch (engine)
+	{
+		case LOCALSTAT_ENGINE_COLUMN:
+		{
+			localstat_column<T> e;
+			return localstat_run_engine(e, src, wsize, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_INTERLEAVED:
+		{
+			localstat_interleaved<T> e;
+			return localstat_run_engine(e, src, wsize, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_CLAMPED:
+		{
+			localstat_clamped<T> e;
+			return localstat_run_engine(e, src, wsize, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_STREAM:
+		{
+			localstat_stream<T> e;
+			return localstat_run_engine(e, src, wsize, nthreads, func);
+		}
+		default:
+		{
+			localstat_integral<T> e;
+			return localstat_run_engine(e, src, wsize, nthreads, func);
+		}
+	}
+}
+
+/*
+	Window sums of values only (func(y, sum1)), using localstat_integral_mean
+*/
+template <typename T, typename F>
+bool localstat_run_mean(const cv::Mat& src, int wsize, F func, int nthreads = 1)
+{
+	localstat_integral_mean<T> e;
+	return localstat_run_engine(e, src, wsize, nthreads, func);
+}
+
+/*
+	Multiple window sizes in a single sweep (one set of integral images built
+	for the largest window): func(y, sum1, sum2) gets wsizes.size()
+	consecutive rows of w elements each.
+*/
+template <typename E, typename F>
+bool localstat_run_engine(E& e, const cv::Mat& src, const std::vector<int>& wsizes, int nthreads, F func)
+{
+	try
+	{
+		if (!e.prepare(src, *std::max_element(wsizes.begin(), wsizes.end()), nthreads))
+			return false;
+		localstat_parallel(nthreads, src.rows, [&](int y0, int y1)
+		{
+			e.rows(y0, y1, wsizes, func);
+		});
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+	catch (const std::length_error&)
+	{
+		return false;
+	}
+	return true;
+}
+
+template <typename T, typename F>
+bool localstat_run(localstat_engine engine, const cv::Mat& src, const std::vector<int>& wsizes, F func, int nthreads = 1)
+{
+	switch (engine)
+	{
+		case LOCALSTAT_ENGINE_COLUMN:
+		{
+			localstat_column<T> e;
+			return localstat_run_engine(e, src, wsizes, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_INTERLEAVED:
+		{
+			localstat_interleaved<T> e;
+			return localstat_run_engine(e, src, wsizes, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_CLAMPED:
+		{
+			localstat_clamped<T> e;
+			return localstat_run_engine(e, src, wsizes, nthreads, func);
+		}
+		case LOCALSTAT_ENGINE_STREAM:
+		{
+			localstat_stream<T> e;
+			return localstat_run_engine(e, src, wsizes, nthreads, func);
+		}
+		default:
+		{
+			localstat_integral<T> e;
+			return localstat_run_engine(e, src, wsizes, nthreads, func);
+		}
+	}
+}
+
+/*
+	Rows [y0, y1) of src only, in the calling thread
+	(rows outside the range are still used as neighbors).
+*/
+template <typename E, typename F>
+bool localstat_run_engine_rows(E& e, const cv::Mat& src, const std::vector<int>& wsizes, int y0, int y1, F func)
+{
+	try
+	{
+		if (!e.prepare(src, *std::max_element(wsizes.begin(), wsizes.end()), 1))
+			return false;
+		if (wsizes.size() == 1)
+			e.rows(y0, y1, func);
+		else
+			e.rows(y0, y1, wsizes, func);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+	catch (const std::length_error&)
+	{
+		return false;
+	}
+	return true;
+}
+
+template <typename T, typename F>
+bool localstat_run_rows(localstat_engine engine, const cv::Mat& src, const std::vector<int>& wsizes, int y0, int y1, F func)
+{
+	switch (engine)
+	{
+		case LOCALSTAT_ENGINE_COLUMN:
+		{
+			localstat_column<T> e;
+			return localstat_run_engine_rows(e, src, wsizes, y0, y1, func);
+		}
+		case LOCALSTAT_ENGINE_INTERLEAVED:
+		{
+			localstat_interleaved<T> e;
+			return localstat_run_engine_rows(e, src, wsizes, y0, y1, func);
+		}
+		case LOCALSTAT_ENGINE_CLAMPED:
+		{
+			localstat_clamped<T> e;
+			return localstat_run_engine_rows(e, src, wsizes, y0, y1, func);
+		}
+		case LOCALSTAT_ENGINE_STREAM:
+		{
+			localstat_stream<T> e;
+			return localstat_run_engine_rows(e, src, wsizes, y0, y1, func);
+		}
+		default:
+		{
+			localstat_integral<T> e;
+			return localstat_run_engine_rows(e, src, wsizes, y0, y1, func);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Row-by-row Image Resampling
+
+	resample.hpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+#ifndef IMGPROC_DH_MICROLIB_RESAMPLE_HPP
+#define IMGPROC_DH_MICROLIB_RESAMPLE_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+	Lanczos4 resampling of an 8-bit grayscale image, producing any range of
+	output rows on demand (without the whole resized image).
+	It follows the fixed-point arithmetic of cv::resize (INTER_LANCZOS4):
+	8-tap coefficients scaled by 2^11, replicated borders and rounding
+	by 2^22 after the vertical pass.
+*/
+class resample_lanczos4
+{
+	const cv::Mat* src;
+	int dw, dh;
+	std::vector<int>   xofs;
+	std::vector<short> alpha;
+	std::vector<int>   yofs;
+	std::vector<short> beta;
+public:
+	resample_lanczos4(const cv::Mat& src, int dw, int dh);
+	int width()  const { return dw; }
+	int height() const { return dh; }
+	// Output rows [y0, y1) (thread-safe)
+	void rows(int y0, int y1, unsigned char* dst, size_t step) const;
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Sauvola's Threshold Kernels
+
+	sauvola.hpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+#ifndef IMGPROC_DH_MICROLIB_SAUVOLA_HPP
+#define IMGPROC_DH_MICROLIB_SAUVOLA_HPP
+
+#include <cstdint>
+
+/*
+	Threshold of a pixel (truncated to int) for each method
+	(m: mean and s: standard deviation of the window):
+	SAUVOLA:    tScale * m * (1 + kParam * (s / rParam - 1)) + tRealBias
+	NIBLACK:    tScale * (m + kParam * s) + tRealBias
+	NICK:       tScale * (m + kParam * sqrt(s^2 + m^2)) + tRealBias
+	PHANSALKAR: tScale * m * (1 + 2 * exp(-10 * m / 255) + kParam * (s / rParam - 1)) + tRealBias
+*/
+enum sauvola_method
+{
+	SAUVOLA_METHOD_SAUVOLA,
+	SAUVOLA_METHOD_NIBLACK,
+	SAUVOLA_METHOD_NICK,
+	SAUVOLA_METHOD_PHANSALKAR,
+};
+
+/*
+	Arithmetic of sauvola_row:
+	FLOAT evaluates twice as many pixels per vector in single precision
+	(AVX2 with 32-bit sums; DOUBLE is used otherwise). The variance is
+	computed exactly in integers, and pixels whose truncated threshold is
+	not certain within the rounding errors are evaluated in double
+	precision, so that the output is identical to DOUBLE.
+*/
+enum sauvola_precision
+{
+	SAUVOLA_PRECISION_DOUBLE,
+	SAUVOLA_PRECISION_FLOAT,
+};
+
+// method and precision may be omitted from initializers (SAUVOLA, DOUBLE)
+struct sauvola_params
+{
+	double invsqWindow;
+	double tScale;
+	double kParam;
+	double rParam;
+	double tRealBias;
+	sauvola_method method;
+	sauvola_precision precision;
+};
+
+enum sauvola_simd
+{
+	SAUVOLA_SIMD_NONE,
+	SAUVOLA_SIMD_SSE42,
+	SAUVOLA_SIMD_AVX2,
+	SAUVOLA_SIMD_AUTO,
+};
+
+/*
+	Select SIMD implementation (clamped to what the CPU supports).
+	Returns the implementation actually in use.
+*/
+sauvola_simd sauvola_set_simd(sauvola_simd simd);
+const char* sauvola_simd_name(sauvola_simd simd);
+
+// Margins of the binary decision without sqrt (SAUVOLA, double precision)
+struct sauvola_decision
+{
+	bool   enabled;
+	double c1;
+	double ck;
+	double eps;
+	double eps2;
+};
+
+struct sauvola_fparams
+{
+	float tScale;
+	float kParam;
+	float rParam;
+	float tRealBias;
+};
+
+// Constants of single precision evaluation (FLOAT)
+struct sauvola_float
+{
+	bool  enabled;
+	uint_least32_t n;
+	float invn;
+	float invn2;
+	float eps;
+	sauvola_fparams fp;
+	int   flat[256]; // thresholds of flat windows by intensity
+};
+
+/*
+	Parameters with everything sauvola_row derives from them, prepared once
+	per parameter set (rows only read it, so they may run concurrently).
+*/
+struct sauvola_kernel
+{
+	sauvola_params   params;
+	sauvola_decision decision;
+	sauvola_float    single;
+};
+
+sauvola_kernel sauvola_prepare(const sauvola_params& params);
+
+/*
+	Process one row from window sums.
+	binary: dst[x] = src[x] > threshold ? 255 : 0
+	otherwise: dst[x] = threshold (lowest 8 bits)
+	All implementations give identical results.
+*/
+void sauvola_row(unsigned char* dst, const unsigned char* src,
+	const uint_least32_t* sum1, const uint_least32_t* sum2,
+	int w, const sauvola_kernel& kernel, bool binary);
+void sauvola_row(unsigned char* dst, const unsigned char* src,
+	const uint_least64_t* sum1, const uint_least64_t* sum2,
+	int w, const sauvola_kernel& kernel, bool binary);
+
+/*
+	Threshold from mean and variance of the window (not truncated),
+	evaluated exactly as in sauvola_row.
+*/
+double sauvola_threshold(double mean, double var, const sauvola_params& params);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+
+	My Image Manipulation Tools for Digital Humanities
+	Local Statistics Cache
+
+	statcache.hpp
+
+	Copyright (C) 2019 Tsukasa OI.
+
+	------------------------------------------------------------------------
+
+	Permission to use, copy, modify, and/or distribute this software for
+	any purpose with or without fee is hereby granted, provided that the
+	above copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+#ifndef IMGPROC_DH_MICROLIB_STATCACHE_HPP
+#define IMGPROC_DH_MICROLIB_STATCACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+static const int STATCACHE_MAX_WINDOWS = 4;
+
+// Decoding of the input (grayscale values may differ between them)
+static const uint32_t STATCACHE_DECODE_GRAYSCALE = 0;
+static const uint32_t STATCACHE_DECODE_COLOR     = 1; // BGR, luminance by localstat_row
+
+/*
+	Everything the cached statistics depend on
+	(compared bytewise; clear with memset before filling)
+*/
+struct statcache_key
+{
+	uint64_t input_hash; // FNV-1a of the input file
+	uint64_t input_size;
+	double   prescale;
+	uint32_t sum_bits;   // width of window sums (32 or 64)
+	uint32_t nwindows;
+	int32_t  windows[STATCACHE_MAX_WINDOWS];
+	uint32_t decode;     // how the input was decoded (see STATCACHE_DECODE_*)
+};
+
+bool statcache_hash_file(const char* filename, uint64_t& hash, uint64_t& size);
+
+/*
+	Memory-mapped sidecar file:
+	header, (prescaled) 8-bit image, and two planes of window sums
+	(each row holds nwindows * width sums, window after window).
+	Native byte order (files from other byte orders are rejected).
+	A new cache is written to a temporary file in the same directory and
+	renamed over FILE when committed, so that other processes mapping
+	FILE never see it change (or an incomplete cache).
+*/
+class statcache
+{
+	int fd;
+	void* map;
+	size_t mapsize;
+	int w, h;
+	size_t offset_image, offset_sum1, offset_sum2;
+	std::string target, temporary; // of a created cache until committed
+	bool layout(const statcache_key& key, int w, int h);
+public:
+	statcache();
+	~statcache();
+	statcache(const statcache&) = delete;
+	statcache& operator=(const statcache&) = delete;
+	// Open an existing cache which matches the key
+	bool open(const char* filename, const statcache_key& key);
+	// Create a new cache (not visible as filename until committed)
+	bool create(const char* filename, const statcache_key& key, int w, int h);
+	// Mark a created cache as complete
+	void commit();
+	void close();
+	bool is_open() const { return map != nullptr; }
+	int width()  const { return w; }
+	int height() const { return h; }
+	unsigned char* image() const { return (unsigned char*)map + offset_image; }
+	void* sum1() const { return (unsigned char*)map + offset_sum1; }
+	void* sum2() const { return (unsigned char*)map + offset_sum2; }
+};
+
+#endif